@@ -40,8 +40,30 @@ I've changed the original file - jujugogoom 2024-12-01
 #include <ctype.h>
 #include <sys/types.h>
 #include <pthread.h>
+#include <sched.h>
 #include <math.h>
 #include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 
 #define MAX_CHAR 127 // Assuming the alphabet size is at most 127
 #define MARKER ")))"
@@ -69,10 +91,61 @@ char *strsep(char **sp, char *sep)
 // Node structure for the BK-Tree
 typedef struct Node
 {
-	char *word;
-	struct Node *children[MAX_CHAR];
+	// Offset of the word in the tree's word pool
+	uint32_t word;
+	// Largest distance that has a child, search can stop looking past it
+	uint8_t maxDistance;
+	// Distance to the parent. Children are a list sorted by it, most nodes only
+	// have a handful so a full table of MAX_CHAR pointers was mostly NULLs
+	uint8_t distance;
+	// Length of the word, UINT16_MAX if it's that long or longer
+	uint16_t length;
+	uint32_t firstChild;
+	uint32_t nextSibling;
+	// Bit set for every character in the word, see word_signature. With length
+	// it gives a lower bound on the distance without looking at the word
+	uint32_t signature;
 } Node;
 
+// Marks the end of a child list, the root is always node 0
+#define NO_NODE UINT32_MAX
+#define ROOT_NODE 0
+
+// The word BK-tree. Nodes sit in one array and point at each other by index,
+// and the words are packed back to back in one pool. Building only grows the
+// two buffers and freeing the tree is two frees instead of two per word
+typedef struct WordTree
+{
+	Node *nodes;
+	uint32_t count;
+	uint32_t capacity;
+	char *words;
+	size_t wordsLength;
+	size_t wordsCapacity;
+	// Set when nodes and words point into a mapped bktree.bin instead
+	void *mapping;
+	size_t mappingSize;
+} WordTree;
+
+// Header of bktree.bin. The node array and word pool follow it exactly as a
+// WordTree holds them in memory, so a loaded file is searched in place
+typedef struct TreeFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	// sizeof(Node) of the writer, also catches a file from a build with a
+	// different layout
+	uint32_t nodeSize;
+	uint32_t count;
+	uint32_t reserved;
+	uint64_t nodesOffset;
+	uint64_t wordsOffset;
+	uint64_t wordsLength;
+} TreeFileHeader;
+
+#define TREE_FILE_MAGIC "BKTREE"
+#define TREE_FILE_VERSION 2
+
 typedef struct ImageNode
 {
 	unsigned long long int hash;
@@ -80,28 +153,41 @@ typedef struct ImageNode
 	struct ImageNode *children[HASH_SIZE];
 } ImageNode;
 
+// A node waiting to be expanded and its distance to the query
+typedef struct SearchItem
+{
+	uint32_t node;
+	int distance;
+} SearchItem;
+
+// The stacks are plain arrays that only grow. A zeroed one is empty, and
+// keeping one around between searches means no allocations once it's big
+// enough
 typedef struct NodeStack
 {
-	struct Node *head;
-	struct NodeStack *next;
+	SearchItem *items;
+	size_t count;
+	size_t capacity;
 } NodeStack;
 
 typedef struct ImageNodeStack
 {
-	struct ImageNode *head;
-	struct ImageNodeStack *next;
+	struct ImageNode **items;
+	size_t count;
+	size_t capacity;
 } ImageNodeStack;
 
+// Words in the order they were pushed, search results are closest first
 typedef struct CharStack
 {
-	char *word;
+	char **words;
 	int len;
-	struct CharStack *next;
+	int capacity;
 } CharStack;
 
 typedef struct IndexingArguments
 {
-	Node **root;
+	WordTree *tree;
 	size_t *total;
 	size_t *completed;
 	bool *done;
@@ -110,7 +196,7 @@ typedef struct IndexingArguments
 
 typedef struct LoadingArguments
 {
-	Node **root;
+	WordTree *tree;
 	size_t *total;
 	size_t *completed;
 	bool *done;
@@ -126,27 +212,211 @@ typedef struct ImageIndexArguments
 	bool *kill;
 } ImageIndexArguments;
 
-unsigned long long int dctTransform(Image image);
+unsigned long long int dctTransform(Image image, const char *path);
 
-// Function to create a new node
-Node *createNode(char *word)
+// Set with --dct-debug, dctTransform then saves a picture of each image's DCT
+// in it. Nothing gets written otherwise
+const char *DctDebugDirectory = NULL;
+
+// Maps a whole file read only. Windows gets a plain read into memory, pulling
+// in windows.h for MapViewOfFile clashes with raylib's names
+void *map_file(const char *path, size_t *size)
 {
-	Node *newNode = (Node *)malloc(sizeof(Node));
-	newNode->word = strdup(word); // Allocate memory for the word
-	Node *children[MAX_CHAR] = {0};
-	memcpy(newNode->children, children, sizeof(children));
-	return newNode;
+#ifdef _WIN32
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return NULL;
+	fseek(file, 0, SEEK_END);
+	long fsize = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	void *data = fsize > 0 ? malloc(fsize) : NULL;
+	if (data != NULL && fread(data, fsize, 1, file) != 1)
+	{
+		free(data);
+		data = NULL;
+	}
+	fclose(file);
+	*size = fsize;
+	return data;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	void *data = NULL;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+	{
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED)
+			data = NULL;
+		*size = st.st_size;
+	}
+	close(fd);
+	return data;
+#endif
 }
 
-ImageNode *createImageNode(Image image, char *path)
+void unmap_file(void *data, size_t size)
 {
-	ImageNode *newNode = malloc(sizeof(ImageNode));
-	newNode->hash = dctTransform(image);
-	newNode->path = strdup(path);
-	printf("Inserting %s with hash %llx\n", newNode->path, newNode->hash);
-	ImageNode *children[HASH_SIZE] = {0};
-	memcpy(newNode->children, children, sizeof(children));
-	return newNode;
+#ifdef _WIN32
+	(void)size;
+	free(data);
+#else
+	munmap(data, size);
+#endif
+}
+
+void init_tree(WordTree *tree)
+{
+	*tree = (WordTree){0};
+}
+
+// Frees the whole tree at once and leaves it empty
+void free_tree(WordTree *tree)
+{
+	if (tree->mapping != NULL)
+	{
+		unmap_file(tree->mapping, tree->mappingSize);
+	}
+	else
+	{
+		free(tree->nodes);
+		free(tree->words);
+	}
+	init_tree(tree);
+}
+
+// Copies a mapped tree into memory it owns so nodes can be added
+void detach_tree(WordTree *tree)
+{
+	Node *nodes = malloc(tree->count * sizeof(Node));
+	char *words = malloc(tree->wordsLength);
+	memcpy(nodes, tree->nodes, tree->count * sizeof(Node));
+	memcpy(words, tree->words, tree->wordsLength);
+	unmap_file(tree->mapping, tree->mappingSize);
+	tree->mapping = NULL;
+	tree->mappingSize = 0;
+	tree->nodes = nodes;
+	tree->words = words;
+}
+
+// Searches may walk a tree while its build is still adding to it. Links and the
+// node count are written with release stores and read with acquire loads, so a
+// reader that sees a link also sees the node and subtree behind it. Nodes are
+// only ever added, and the arrays don't move until the build is over
+uint32_t load_link(const uint32_t *link)
+{
+	return __atomic_load_n(link, __ATOMIC_ACQUIRE);
+}
+
+void publish_link(uint32_t *link, uint32_t node)
+{
+	__atomic_store_n(link, node, __ATOMIC_RELEASE);
+}
+
+uint32_t tree_count(const WordTree *tree)
+{
+	return __atomic_load_n(&tree->count, __ATOMIC_ACQUIRE);
+}
+
+void publish_count(WordTree *tree, uint32_t count)
+{
+	__atomic_store_n(&tree->count, count, __ATOMIC_RELEASE);
+}
+
+// A stale maxDistance only hides children that were just added
+int max_distance(const Node *node)
+{
+	return __atomic_load_n(&node->maxDistance, __ATOMIC_RELAXED);
+}
+
+// Hands a tree built elsewhere to an empty tree that searches may be reading
+void publish_tree(WordTree *tree, WordTree *built)
+{
+	uint32_t count = built->count;
+	built->count = 0;
+	*tree = *built;
+	publish_count(tree, count);
+	init_tree(built);
+}
+
+// Makes room for at least nodes nodes and words bytes of words
+void reserve_tree(WordTree *tree, uint32_t nodes, size_t words)
+{
+	if (tree->mapping != NULL)
+	{
+		detach_tree(tree);
+	}
+	if (nodes > tree->capacity)
+	{
+		while (nodes > tree->capacity)
+			tree->capacity = tree->capacity ? tree->capacity * 2 : 1024;
+		tree->nodes = realloc(tree->nodes, tree->capacity * sizeof(Node));
+	}
+	if (words > tree->wordsCapacity)
+	{
+		while (words > tree->wordsCapacity)
+			tree->wordsCapacity = tree->wordsCapacity ? tree->wordsCapacity * 2 : 8192;
+		tree->words = realloc(tree->words, tree->wordsCapacity);
+	}
+}
+
+// Characters are hashed to their low 5 bits, so every lowercase letter gets a
+// bit of its own. Sharing bits only makes the bound from it smaller
+uint32_t word_signature(const char *word)
+{
+	uint32_t signature = 0;
+	for (; *word; word++)
+		signature |= (uint32_t)1 << (*word & 31);
+	return signature;
+}
+
+// Function to create a new node, returns its index. Node pointers into the
+// tree aren't valid across this since the array may move
+uint32_t createNode(WordTree *tree, const char *word)
+{
+	size_t len = strlen(word) + 1;
+	reserve_tree(tree, tree->count + 1, tree->wordsLength + len);
+	Node *newNode = &tree->nodes[tree->count];
+	newNode->word = tree->wordsLength;
+	memcpy(tree->words + tree->wordsLength, word, len);
+	tree->wordsLength += len;
+	newNode->maxDistance = 0;
+	newNode->distance = 0;
+	newNode->length = len - 1 < UINT16_MAX ? len - 1 : UINT16_MAX;
+	newNode->signature = word_signature(word);
+	newNode->firstChild = NO_NODE;
+	newNode->nextSibling = NO_NODE;
+	publish_count(tree, tree->count + 1);
+	return tree->count - 1;
+}
+
+char *node_word(const WordTree *tree, uint32_t node)
+{
+	return tree->words + tree->nodes[node].word;
+}
+
+// Where the child at distance is, or where it would go to keep the list sorted
+uint32_t *child_link(WordTree *tree, uint32_t node, int distance)
+{
+	uint32_t *link = &tree->nodes[node].firstChild;
+	uint32_t next;
+	while ((next = load_link(link)) != NO_NODE && tree->nodes[next].distance < distance)
+	{
+		link = &tree->nodes[next].nextSibling;
+	}
+	return link;
+}
+
+// Links child under node at distance, which must not have a child yet
+void add_child(WordTree *tree, uint32_t node, uint32_t child, int distance)
+{
+	uint32_t *link = child_link(tree, node, distance);
+	tree->nodes[child].distance = distance;
+	tree->nodes[child].nextSibling = *link;
+	publish_link(link, child);
+	if (distance > tree->nodes[node].maxDistance)
+		__atomic_store_n(&tree->nodes[node].maxDistance, distance, __ATOMIC_RELAXED);
 }
 
 ImageNode *createImageNodeWithHash(char *path, unsigned long long int hash)
@@ -160,22 +430,6 @@ ImageNode *createImageNodeWithHash(char *path, unsigned long long int hash)
 	return newNode;
 }
 
-// Frees malloc'd data as well as all children, can be used to destruct whole tree
-void freeNode(Node *node)
-{
-	if (node == NULL)
-	{
-		return;
-	}
-	free(node->word);
-	for (int i = 0; i < MAX_CHAR; i++)
-	{
-		freeNode(node->children[i]);
-		node->children[i] = NULL;
-	}
-	free(node);
-}
-
 void freeImageNode(ImageNode *node)
 {
 	if (node == NULL)
@@ -191,93 +445,92 @@ void freeImageNode(ImageNode *node)
 	free(node);
 }
 
-NodeStack *push_node(NodeStack *stack, Node *node)
+void push_node(NodeStack *stack, uint32_t node, int distance)
 {
-	NodeStack *new = (NodeStack *)malloc(sizeof(NodeStack));
-	new->head = node;
-	new->next = stack;
-	return new;
+	if (stack->count == stack->capacity)
+	{
+		stack->capacity = stack->capacity == 0 ? 64 : stack->capacity * 2;
+		stack->items = realloc(stack->items, stack->capacity * sizeof(SearchItem));
+	}
+	stack->items[stack->count++] = (SearchItem){node, distance};
 }
 
-Node *pop_node(NodeStack **stack)
+uint32_t pop_node(NodeStack *stack, int *distance)
 {
-	if (stack == NULL)
+	if (stack->count == 0)
 	{
-		return NULL;
+		return NO_NODE;
 	}
-	Node *ret = (*stack)->head;
-	NodeStack *last = *stack;
-	*stack = (*stack)->next;
-	free(last);
-	return ret;
+	SearchItem item = stack->items[--stack->count];
+	if (distance != NULL)
+		*distance = item.distance;
+	return item.node;
+}
+
+void free_node_stack(NodeStack *stack)
+{
+	free(stack->items);
+	*stack = (NodeStack){0};
 }
 
-ImageNodeStack *push_image_node(ImageNodeStack *stack, ImageNode *node)
+void push_image_node(ImageNodeStack *stack, ImageNode *node)
 {
-	ImageNodeStack *new = malloc(sizeof(ImageNodeStack));
-	new->head = node;
-	new->next = stack;
-	return new;
+	if (stack->count == stack->capacity)
+	{
+		stack->capacity = stack->capacity == 0 ? 64 : stack->capacity * 2;
+		stack->items = realloc(stack->items, stack->capacity * sizeof(ImageNode *));
+	}
+	stack->items[stack->count++] = node;
 }
 
-ImageNode *pop_image_node(ImageNodeStack **stack)
+ImageNode *pop_image_node(ImageNodeStack *stack)
 {
-	if (stack == NULL)
+	if (stack->count == 0)
 	{
 		return NULL;
 	}
-	ImageNode *ret = (*stack)->head;
-	ImageNodeStack *last = *stack;
-	*stack = (*stack)->next;
-	free(last);
-	return ret;
+	return stack->items[--stack->count];
 }
 
-CharStack *push_char(CharStack *stack, char *word)
+void free_image_stack(ImageNodeStack *stack)
 {
-	CharStack *new = (CharStack *)malloc(sizeof(CharStack));
-	new->word = word;
-	new->next = stack;
-	new->len = stack == NULL ? 1 : stack->len + 1;
-	return new;
+	free(stack->items);
+	*stack = (ImageNodeStack){0};
 }
 
-CharStack *push_back_char(CharStack *stack, char *word)
+void push_char(CharStack *stack, char *word)
 {
-	if (stack == NULL)
-	{
-		return push_char(stack, word);
-	}
-	CharStack *curr = stack;
-	while (1)
+	if (stack->len == stack->capacity)
 	{
-		CharStack *next = curr->next;
-		if (next == NULL)
-		{
-			CharStack *new = (CharStack *)malloc(sizeof(CharStack));
-			new->word = word;
-			new->len = 1;
-			new->next = NULL;
-			curr->next = new;
-			stack->len++;
-			return stack;
-		}
-		curr = next;
+		stack->capacity = stack->capacity == 0 ? 16 : stack->capacity * 2;
+		stack->words = realloc(stack->words, stack->capacity * sizeof(char *));
 	}
-	return stack;
+	stack->words[stack->len++] = word;
 }
 
-char *pop_char(CharStack **stack)
+char *pop_char(CharStack *stack)
 {
-	if (*stack == NULL)
+	if (stack->len == 0)
 	{
 		return NULL;
 	}
-	char *ret = (*stack)->word;
-	CharStack *last = *stack;
-	*stack = (*stack)->next;
-	free(last);
-	return ret;
+	return stack->words[--stack->len];
+}
+
+void free_chars(CharStack *stack)
+{
+	free(stack->words);
+	*stack = (CharStack){0};
+}
+
+int min(int a, int b)
+{
+	return a < b ? a : b;
+}
+
+int max(int a, int b)
+{
+	return a > b ? a : b;
 }
 
 int min4(int a, int b, int c, int d)
@@ -292,30 +545,144 @@ int min4(int a, int b, int c, int d)
 	return min;
 }
 
-int damerau_levenshtein_distance(const char *a, const char *b)
+// Bit-vector state for one 64 character block of the pattern in osa_distance_blocked
+typedef struct OsaBlock
 {
-	int len_a = strlen(a);
-	int len_b = strlen(b);
-	// Create da array to store the last occurrence of each character
-	int *da = calloc(sizeof(int), MAX_CHAR);
-	// Create d array (with extra rows and columns for initialization)
-	int **d = malloc((len_a + 2) * sizeof(int *));
-	for (int i = 0; i <= len_a + 1; i++)
+	uint64_t VP;
+	uint64_t VN;
+	uint64_t D0;
+	uint64_t PM;
+} OsaBlock;
+
+// Scratch space for the distance functions. Each thread owns one and it only
+// grows, so once it fits the longest pair of words seen no further allocation
+// happens. The lookup tables are all zero between calls, each call only clears
+// the entries it touched
+typedef struct DistanceWorkspace
+{
+	int *d;
+	size_t capacity;
+	int da[UCHAR_MAX + 1];
+	// Character counts for the transposition check
+	int counts[UCHAR_MAX + 1];
+	// Match masks of the pattern for the single word bit-parallel engine
+	uint64_t peq[UCHAR_MAX + 1];
+	// Positions of each character in both strings for the transposition check
+	uint64_t positions[2][UCHAR_MAX + 1];
+	// Match masks and row state for patterns longer than 64 characters
+	uint64_t *blockPeq;
+	OsaBlock *blocks;
+	size_t blockCapacity;
+	// search's node stack and words found at each distance, reused between
+	// queries
+	NodeStack stack;
+	CharStack *potential;
+	int potentialCount;
+	// Children expand_node ruled out from their length and signature alone, and
+	// ones it had to compute the distance for
+	uint64_t filtered;
+	uint64_t computed;
+} DistanceWorkspace;
+
+void init_workspace(DistanceWorkspace *ws)
+{
+	ws->d = NULL;
+	ws->capacity = 0;
+	memset(ws->da, 0, sizeof(ws->da));
+	memset(ws->counts, 0, sizeof(ws->counts));
+	memset(ws->peq, 0, sizeof(ws->peq));
+	memset(ws->positions, 0, sizeof(ws->positions));
+	ws->blockPeq = NULL;
+	ws->blocks = NULL;
+	ws->blockCapacity = 0;
+	ws->stack = (NodeStack){0};
+	ws->potential = NULL;
+	ws->potentialCount = 0;
+	ws->filtered = 0;
+	ws->computed = 0;
+}
+
+void free_workspace(DistanceWorkspace *ws)
+{
+	free(ws->d);
+	ws->d = NULL;
+	ws->capacity = 0;
+	free(ws->blockPeq);
+	free(ws->blocks);
+	ws->blockPeq = NULL;
+	ws->blocks = NULL;
+	ws->blockCapacity = 0;
+	free_node_stack(&ws->stack);
+	for (int i = 0; i < ws->potentialCount; i++)
+	{
+		free_chars(&ws->potential[i]);
+	}
+	free(ws->potential);
+	ws->potential = NULL;
+	ws->potentialCount = 0;
+}
+
+// Make sure the workspace has a bucket for each distance up to radius
+CharStack *reserve_potential(DistanceWorkspace *ws, int radius)
+{
+	if (radius + 1 > ws->potentialCount)
+	{
+		ws->potential = realloc(ws->potential, (radius + 1) * sizeof(CharStack));
+		for (int i = ws->potentialCount; i < radius + 1; i++)
+		{
+			ws->potential[i] = (CharStack){0};
+		}
+		ws->potentialCount = radius + 1;
+	}
+	return ws->potential;
+}
+
+// Make sure the workspace can hold a rows x cols matrix
+int *reserve_workspace(DistanceWorkspace *ws, size_t rows, size_t cols)
+{
+	size_t needed = rows * cols;
+	if (needed > ws->capacity)
+	{
+		free(ws->d);
+		ws->d = malloc(needed * sizeof(int));
+		ws->capacity = needed;
+	}
+	return ws->d;
+}
+
+// Make sure the workspace can hold the tables for a pattern of the given number of 64 bit blocks
+void reserve_blocks(DistanceWorkspace *ws, size_t words)
+{
+	if (words > ws->blockCapacity)
 	{
-		d[i] = malloc((len_b + 2) * sizeof(int));
+		free(ws->blockPeq);
+		free(ws->blocks);
+		ws->blockPeq = calloc((UCHAR_MAX + 1) * words, sizeof(uint64_t));
+		ws->blocks = malloc(2 * (words + 1) * sizeof(OsaBlock));
+		ws->blockCapacity = words;
 	}
+}
+
+// Full dynamic programming matrix, kept as the reference the faster paths fall back to
+int damerau_levenshtein_distance_dp(DistanceWorkspace *ws, const char *a, int len_a, const char *b, int len_b)
+{
+	// d is a flat (len_a + 2) x (len_b + 2) matrix (extra rows and columns for initialization)
+	int cols = len_b + 2;
+	int *d = reserve_workspace(ws, len_a + 2, cols);
+	// da stores the last occurrence of each character, all zero between calls
+	int *da = ws->da;
 	// Initialize d array
 	int maxdist = len_a + len_b;
-	d[0][0] = maxdist;
+	d[0] = maxdist;
 	for (int i = 0; i <= len_a; i++)
 	{
-		d[i + 1][0] = maxdist;
-		d[i + 1][1] = i;
+		d[(i + 1) * cols] = maxdist;
+		d[(i + 1) * cols + 1] = i;
 	}
 	for (int j = 0; j <= len_b; j++)
 	{
-		d[0][j + 1] = maxdist;
-		d[1][j + 1] = j;
+		d[j + 1] = maxdist;
+		d[cols + j + 1] = j;
 	}
 	// Calculate Damerau-Levenshtein distance
 	for (int i = 1; i <= len_a; i++)
@@ -323,591 +690,5237 @@ int damerau_levenshtein_distance(const char *a, const char *b)
 		int db = 0;
 		for (int j = 1; j <= len_b; j++)
 		{
-			int k = da[b[j - 1]];
+			int k = da[(unsigned char)b[j - 1]];
 			int l = db;
 			int cost = (a[i - 1] == b[j - 1]) ? 0 : 1;
 			if (cost == 0)
 				db = j;
-			d[i + 1][j + 1] =
-				min4(d[i][j] + cost,						   // Substitution
-					 d[i + 1][j] + 1,						   // Insertion
-					 d[i][j + 1] + 1,						   // Deletion
-					 d[k][l] + (i - k - 1) + 1 + (j - l - 1)); // Transposition
+			d[(i + 1) * cols + j + 1] =
+				min4(d[i * cols + j] + cost,						   // Substitution
+					 d[(i + 1) * cols + j] + 1,						   // Insertion
+					 d[i * cols + j + 1] + 1,						   // Deletion
+					 d[k * cols + l] + (i - k - 1) + 1 + (j - l - 1)); // Transposition
 		}
-		da[a[i - 1]] = i;
+		da[(unsigned char)a[i - 1]] = i;
 	}
-	int res = d[len_a + 1][len_b + 1];
-	// Free allocated memory
-	free(da);
-	for (int i = 0; i <= len_a + 1; i++)
+	int res = d[(len_a + 1) * cols + len_b + 1];
+	// Only characters of a were recorded, clear them for the next call
+	for (int i = 0; i < len_a; i++)
 	{
-		free(d[i]);
+		da[(unsigned char)a[i]] = 0;
 	}
-	free(d);
 
 	return res;
 }
 
-void insert(Node *root, char *word)
+// Same distance as damerau_levenshtein_distance_dp, but only exact up to limit.
+// Anything further returns limit + 1, which lets us only fill the diagonal band
+// |i - j| <= limit and give up as soon as a whole row is past the limit
+int damerau_levenshtein_distance_banded(DistanceWorkspace *ws, const char *a, int len_a, const char *b, int len_b, int limit)
 {
-	if (word == NULL || strlen(word) == 0)
+	int cap = limit + 1;
+	if (limit < 0 || abs(len_a - len_b) > limit)
 	{
-		return;
+		return cap;
 	}
-
-	Node *curr = root;
-	while (curr != NULL)
+	int cols = len_b + 2;
+	int *d = reserve_workspace(ws, len_a + 2, cols);
+	int *da = ws->da;
+	// Cells outside the band are never written, they all read as cap
+	d[0] = cap;
+	for (int i = 0; i <= len_a; i++)
 	{
-		int distance = damerau_levenshtein_distance(curr->word, word);
-		if (distance == 0)
+		d[(i + 1) * cols] = cap;
+		d[(i + 1) * cols + 1] = min(i, cap);
+	}
+	for (int j = 0; j <= len_b; j++)
+	{
+		d[j + 1] = cap;
+		d[cols + j + 1] = min(j, cap);
+	}
+	int res = cap;
+	int i;
+	for (i = 1; i <= len_a; i++)
+	{
+		int db = 0;
+		int lo = max(1, i - limit);
+		int hi = min(len_b, i + limit);
+		// Column 0 is part of the band for the first limit rows
+		int rowMin = min(i, cap);
+		// Left and right neighbours of the band in this row
+		if (lo > 1)
+			d[(i + 1) * cols + lo] = cap;
+		if (hi < len_b)
+			d[(i + 1) * cols + hi + 2] = cap;
+		// db still has to see the matches left of the band
+		for (int j = 1; j < lo; j++)
 		{
-			return;
+			if (a[i - 1] == b[j - 1])
+				db = j;
 		}
-		int index = distance % MAX_CHAR; // Hash the distance to find the child
-		Node *next = curr->children[index];
-		if (next == NULL)
+		for (int j = lo; j <= hi; j++)
 		{
-			next = createNode(word);
-			curr->children[index] = next;
-			return;
+			int k = da[(unsigned char)b[j - 1]];
+			int l = db;
+			int cost = (a[i - 1] == b[j - 1]) ? 0 : 1;
+			if (cost == 0)
+				db = j;
+			int transposition = cap;
+			if (k > 0 && l > 0 && abs(k - l) <= limit)
+				transposition = d[k * cols + l] + (i - k - 1) + 1 + (j - l - 1);
+			int val = min(cap, min4(d[i * cols + j] + cost,	  // Substitution
+									d[(i + 1) * cols + j] + 1,  // Insertion
+									d[i * cols + j + 1] + 1,	  // Deletion
+									transposition));			  // Transposition
+			d[(i + 1) * cols + j + 1] = val;
+			if (val < rowMin)
+				rowMin = val;
 		}
-		curr = next;
+		da[(unsigned char)a[i - 1]] = i;
+		if (rowMin > limit)
+			break;
 	}
+	if (i > len_a)
+		res = d[(len_a + 1) * cols + len_b + 1];
+	for (int c = 0; c < len_a; c++)
+	{
+		da[(unsigned char)a[c]] = 0;
+	}
+	return res;
 }
 
-int min(int a, int b)
+// Optimal string alignment (restricted Damerau-Levenshtein) distance between a
+// pattern of at most 64 characters, given by its match masks, and text. This is
+// Hyyro's transposition extension of Myers' bit-vector algorithm: one column of
+// the matrix is kept as vertical +1/-1 deltas in VP/VN and each of the len_t
+// text characters advances it with a handful of word operations
+int osa_distance_word(const uint64_t *peq, int len_p, const char *text, int len_t)
 {
-	return a < b ? a : b;
+	uint64_t VP = ~(uint64_t)0;
+	uint64_t VN = 0;
+	uint64_t D0 = 0;
+	uint64_t PM_old = 0;
+	uint64_t last = (uint64_t)1 << (len_p - 1);
+	int dist = len_p;
+	for (int t = 0; t < len_t; t++)
+	{
+		uint64_t PM = peq[(unsigned char)text[t]];
+		// Transpositions are matches shifted by one that weren't already a diagonal match
+		uint64_t TR = (((~D0) & PM) << 1) & PM_old;
+		D0 = (((PM & VP) + VP) ^ VP) | PM | VN | TR;
+		uint64_t HP = VN | ~(D0 | VP);
+		uint64_t HN = D0 & VP;
+		if (HP & last)
+			dist++;
+		if (HN & last)
+			dist--;
+		HP = (HP << 1) | 1;
+		HN = HN << 1;
+		VP = HN | ~(D0 | HP);
+		VN = HP & D0;
+		PM_old = PM;
+	}
+	return dist;
 }
 
-int max(int a, int b)
+// Same as osa_distance_word for patterns longer than 64 characters, the column
+// is split in 64 bit blocks and the horizontal deltas carry from one to the next
+int osa_distance_blocked(DistanceWorkspace *ws, const uint64_t *peq, int words, int len_p, const char *text)
 {
-	return a > b ? a : b;
+	OsaBlock *old_rows = ws->blocks;
+	OsaBlock *new_rows = ws->blocks + words + 1;
+	for (int w = 0; w <= words; w++)
+	{
+		old_rows[w] = (OsaBlock){.VP = ~(uint64_t)0, .VN = 0, .D0 = 0, .PM = 0};
+		new_rows[w] = old_rows[w];
+	}
+	uint64_t last = (uint64_t)1 << ((len_p - 1) % 64);
+	int dist = len_p;
+	for (; *text; text++)
+	{
+		uint64_t HP_carry = 1;
+		uint64_t HN_carry = 0;
+		const uint64_t *PM_row = peq + (size_t)(unsigned char)*text * words;
+		for (int w = 0; w < words; w++)
+		{
+			uint64_t VP = old_rows[w + 1].VP;
+			uint64_t VN = old_rows[w + 1].VN;
+			uint64_t D0 = old_rows[w + 1].D0;
+			uint64_t PM_old = old_rows[w + 1].PM;
+			// State of the block below for the transposition carry
+			uint64_t D0_prev = old_rows[w].D0;
+			uint64_t PM_prev = new_rows[w].PM;
+			uint64_t PM = PM_row[w];
+			uint64_t TR = ((((~D0) & PM) << 1) | (((~D0_prev) & PM_prev) >> 63)) & PM_old;
+			uint64_t X = PM | HN_carry;
+			D0 = (((X & VP) + VP) ^ VP) | X | VN | TR;
+			uint64_t HP = VN | ~(D0 | VP);
+			uint64_t HN = D0 & VP;
+			if (w == words - 1)
+			{
+				if (HP & last)
+					dist++;
+				if (HN & last)
+					dist--;
+			}
+			uint64_t HP_next = HP >> 63;
+			uint64_t HN_next = HN >> 63;
+			HP = (HP << 1) | HP_carry;
+			HN = (HN << 1) | HN_carry;
+			HP_carry = HP_next;
+			HN_carry = HN_next;
+			new_rows[w + 1].VP = HN | ~(D0 | HP);
+			new_rows[w + 1].VN = HP & D0;
+			new_rows[w + 1].D0 = D0;
+			new_rows[w + 1].PM = PM;
+		}
+		OsaBlock *tmp = old_rows;
+		old_rows = new_rows;
+		new_rows = tmp;
+	}
+	return dist;
 }
 
-// Function to search for words within a given radius in the BK-Tree
-CharStack *search(Node *root, char *query, int radius, int max)
+// Optimal string alignment distance, picking the single word engine whenever
+// the shorter string fits in 64 characters
+int osa_distance_ws(DistanceWorkspace *ws, const char *a, int len_a, const char *b, int len_b)
 {
-	if (root == NULL)
+	// The shorter string is the pattern, the distance is symmetric
+	if (len_a > len_b)
 	{
-		return NULL;
+		const char *tmp = a;
+		a = b;
+		b = tmp;
+		int tmp_len = len_a;
+		len_a = len_b;
+		len_b = tmp_len;
 	}
-	NodeStack *stack = push_node(NULL, root);
-	CharStack *potential[radius + 1];
-	for (int i = 0; i < radius + 1; i++)
+	if (len_a == 0)
 	{
-		potential[i] = NULL;
+		return len_b;
 	}
-	CharStack *results = NULL;
-	while (stack != NULL)
+	int res;
+	if (len_a <= 64)
 	{
-		Node *curr = pop_node(&stack);
-		int distance = damerau_levenshtein_distance(curr->word, query);
-		if (distance <= radius)
-		{
-			potential[distance] = push_char(potential[distance], curr->word);
-		}
-		int lower = fmax(distance - radius, 0);
-		int upper = min(distance + radius, MAX_CHAR - 1);
-		for (int i = lower; i <= upper; i++)
-		{
-			if (curr->children[i])
-			{
-				stack = push_node(stack, curr->children[i]);
-			}
-		}
+		uint64_t *peq = ws->peq;
+		for (int i = 0; i < len_a; i++)
+			peq[(unsigned char)a[i]] |= (uint64_t)1 << i;
+		res = osa_distance_word(peq, len_a, b, len_b);
+		for (int i = 0; i < len_a; i++)
+			peq[(unsigned char)a[i]] = 0;
 	}
-	int curr_dist = 0;
-	while ((results == NULL || results->len < max) && curr_dist <= radius)
+	else
 	{
-		char *res = pop_char(&potential[curr_dist]);
-		if (res == NULL)
-		{
-			curr_dist++;
-		}
-		else
-		{
-			results = push_back_char(results, res);
-		}
+		int words = (len_a + 63) / 64;
+		reserve_blocks(ws, words);
+		uint64_t *peq = ws->blockPeq;
+		for (int i = 0; i < len_a; i++)
+			peq[(size_t)(unsigned char)a[i] * words + i / 64] |= (uint64_t)1 << (i % 64);
+		res = osa_distance_blocked(ws, peq, words, len_a, b);
+		for (int i = 0; i < len_a; i++)
+			peq[(size_t)(unsigned char)a[i] * words + i / 64] = 0;
 	}
-	return results;
+	return res;
 }
 
-char *ltrim(char *s)
+// Lower bound on the edit distance between a[a0..a1) and b[b0..b1): every
+// character one side has more of than the other needs its own edit
+int count_bound(DistanceWorkspace *ws, const char *a, int a0, int a1, const char *b, int b0, int b1)
 {
-	while (isspace(*s))
-		s++;
-	return s;
+	int *counts = ws->counts;
+	for (int i = a0; i < a1; i++)
+		counts[(unsigned char)a[i]]++;
+	for (int j = b0; j < b1; j++)
+		counts[(unsigned char)b[j]]--;
+	int extra_a = 0;
+	int extra_b = 0;
+	for (int i = a0; i < a1; i++)
+	{
+		int c = counts[(unsigned char)a[i]];
+		if (c > 0)
+			extra_a += c;
+		counts[(unsigned char)a[i]] = 0;
+	}
+	for (int j = b0; j < b1; j++)
+	{
+		int c = counts[(unsigned char)b[j]];
+		if (c < 0)
+			extra_b -= c;
+		counts[(unsigned char)b[j]] = 0;
+	}
+	return max(extra_a, extra_b);
 }
 
-char *rtrim(char *s)
+// Lower bound on the edit distance between two strings given the sets of
+// characters in them: each character only one side has needs its own edit
+int set_bound(uint64_t a, uint64_t b)
 {
-	char *back = s + strlen(s);
-	while (isspace(*--back))
-		;
-	*(back + 1) = '\0';
-	return s;
+	return max(__builtin_popcountll(a & ~b), __builtin_popcountll(b & ~a));
 }
 
-char *trim(char *s)
+// A string of at most 64 characters with the tables the transposition check
+// needs. positions has a bit per position for every character, which doubles
+// as the match masks when the string is the pattern of osa_distance_word
+typedef struct PreparedString
 {
-	return rtrim(ltrim(s));
-}
+	const char *text;
+	int len;
+	uint64_t *positions;
+	// Character sets of every prefix and suffix
+	uint64_t prefix[65];
+	uint64_t suffix[65];
+} PreparedString;
 
-void *create_tree(void *args)
+void fill_positions(PreparedString *s, uint64_t *positions)
 {
-	struct IndexingArguments *arguments = args;
-
-	Node **root = arguments->root;
-	size_t *completed = arguments->completed;
-	FILE *fp;
-	char line[128];
-	size_t len = 0;
-
-	fp = fopen("words.txt", "r");
-	if (fp == NULL)
-		exit(EXIT_FAILURE);
-	fseek(fp, 0, SEEK_END);
-	long fsize = ftell(fp);
-	fseek(fp, 0, SEEK_SET); /* same as rewind(f); */
-	// printf("Filesize %d", fsize);
-	char *string = malloc(fsize + 1);
-	fread(string, fsize, 1, fp);
-	fclose(fp);
+	s->positions = positions;
+	for (int i = 0; i < s->len; i++)
+		positions[(unsigned char)s->text[i]] |= (uint64_t)1 << i;
+}
 
-	*arguments->total = fsize;
+void clear_positions(PreparedString *s)
+{
+	for (int i = 0; i < s->len; i++)
+		s->positions[(unsigned char)s->text[i]] = 0;
+}
 
-	string[fsize] = 0;
-	char *first_word = strtok(string, "\n");
-	*completed = strlen(first_word) + 1;
-	first_word = trim(first_word);
-	*root = createNode(first_word);
-	char *to_insert = strtok(NULL, "\n");
-	while (to_insert && !*arguments->kill)
-	{
-		// printf("Inserting %s", to_insert);
-		*completed += strlen(to_insert) + 1;
-		insert(*root, trim(to_insert));
-		to_insert = strtok(NULL, "\n");
-	}
-	*arguments->done = true;
-	free(string);
-	pthread_exit(0);
+// Characters are hashed to their low 6 bits, which can only make set_bound smaller
+void fill_prefix_sets(PreparedString *s)
+{
+	s->prefix[0] = 0;
+	for (int i = 0; i < s->len; i++)
+		s->prefix[i + 1] = s->prefix[i] | (uint64_t)1 << ((unsigned char)s->text[i] & 63);
+	s->suffix[s->len] = 0;
+	for (int i = s->len - 1; i >= 0; i--)
+		s->suffix[i] = s->suffix[i + 1] | (uint64_t)1 << ((unsigned char)s->text[i] & 63);
 }
 
-void serialize(Node *root, FILE *fp)
+// One direction of gapped_transposition_possible, with the adjacent pair in a
+bool gapped_transposition_one_side(DistanceWorkspace *ws, const PreparedString *a, const PreparedString *b, int osa)
 {
-	// Base case
-	if (root == NULL)
+	for (int i = 1; i < a->len; i++)
+	{
+		unsigned char y = a->text[i - 1];
+		unsigned char x = a->text[i];
+		uint64_t xs = b->positions[x];
+		uint64_t ys = b->positions[y];
+		// Needs an x in b at least two before a y
+		if (x == y || xs == 0 || ys == 0 || __builtin_ctzll(xs) + 2 > 63 - __builtin_clzll(ys))
+			continue;
+		while (ys)
+		{
+			int j = __builtin_ctzll(ys);
+			ys &= ys - 1;
+			// x positions at most j - 2
+			uint64_t ls = xs & ((((uint64_t)1 << j) - 1) >> 1);
+			while (ls)
+			{
+				int l = 63 - __builtin_clzll(ls);
+				ls &= ~((uint64_t)1 << l);
+				// Cheapest path through this transposition: the prefixes, the swap
+				// and the inserted gap, then the suffixes
+				int bound = j - l;
+				if (bound >= osa)
+					break;
+				if (bound + abs((i - 1) - l) + abs((a->len - i - 1) - (b->len - j - 1)) >= osa)
+					continue;
+				if (bound + set_bound(a->prefix[i - 1], b->prefix[l]) + set_bound(a->suffix[i + 1], b->suffix[j + 1]) >= osa)
+					continue;
+				bound += count_bound(ws, a->text, 0, i - 1, b->text, 0, l) + count_bound(ws, a->text, i + 1, a->len, b->text, j + 1, b->len);
+				if (bound < osa)
+					return true;
+			}
+		}
+	}
+	return false;
+}
+
+// Checks whether a transposition with a gap on one side ("xy" against "y...x"),
+// the only move unrestricted Damerau-Levenshtein has that the optimal string
+// alignment distance can't match at the same cost, could bring the distance
+// between a and b under osa. Gaps on both sides cost at least as much as
+// substituting both ends and editing what's between
+bool gapped_transposition_possible(DistanceWorkspace *ws, const PreparedString *a, const PreparedString *b, int osa)
+{
+	return gapped_transposition_one_side(ws, a, b, osa) || gapped_transposition_one_side(ws, b, a, osa);
+}
+
+// Unrestricted Damerau-Levenshtein is never more than the optimal string
+// alignment distance and only differs through gapped transpositions, each of
+// which costs at least two and saves at most one. So the bit-parallel result is
+// taken as is unless one of those could beat it, and bounds the banded DP
+// otherwise. a has its tables filled in, b only gets them built if the check has
+// to run. Returns the distance if it's at most limit, limit + 1 if not
+int damerau_levenshtein_from_osa(DistanceWorkspace *ws, PreparedString *a, const char *b, int len_b, int osa, int limit)
+{
+	if (osa <= 2 || (2 * osa + 2) / 3 > limit)
+	{
+		return min(osa, limit + 1);
+	}
+	bool exact;
+	if (len_b <= 64)
+	{
+		PreparedString other = {.text = b, .len = len_b};
+		fill_positions(&other, ws->positions[1]);
+		fill_prefix_sets(&other);
+		exact = !gapped_transposition_possible(ws, a, &other, osa);
+		clear_positions(&other);
+	}
+	else
+	{
+		exact = false;
+	}
+	if (exact)
+	{
+		return min(osa, limit + 1);
+	}
+	int banded = min(limit, osa - 1);
+	int res = damerau_levenshtein_distance_banded(ws, a->text, a->len, b, len_b, banded);
+	if (res <= banded)
+	{
+		return res;
+	}
+	return min(osa, limit + 1);
+}
+
+// Distance between a, the pattern of the bit-parallel engine, and b
+int damerau_levenshtein_prepared(DistanceWorkspace *ws, PreparedString *a, const char *b, int len_b, int limit)
+{
+	if (limit < 0 || abs(a->len - len_b) > limit)
+	{
+		return limit + 1;
+	}
+	if (a->len == 0 || len_b == 0)
+	{
+		return max(a->len, len_b);
+	}
+	return damerau_levenshtein_from_osa(ws, a, b, len_b, osa_distance_word(a->positions, a->len, b, len_b), limit);
+}
+
+// Same as damerau_levenshtein_prepared without tables for either string
+int damerau_levenshtein_dispatch(DistanceWorkspace *ws, const char *a, int len_a, const char *b, int len_b, int limit)
+{
+	// The shorter string is the pattern, the distance is symmetric
+	if (len_a > len_b)
+	{
+		return damerau_levenshtein_dispatch(ws, b, len_b, a, len_a, limit);
+	}
+	if (len_a > 64)
+	{
+		if (limit < 0 || abs(len_a - len_b) > limit)
+		{
+			return limit + 1;
+		}
+		int osa = osa_distance_ws(ws, a, len_a, b, len_b);
+		if (osa <= 2 || (2 * osa + 2) / 3 > limit)
+		{
+			return min(osa, limit + 1);
+		}
+		int banded = min(limit, osa - 1);
+		int res = damerau_levenshtein_distance_banded(ws, a, len_a, b, len_b, banded);
+		return res <= banded ? res : min(osa, limit + 1);
+	}
+	PreparedString pattern = {.text = a, .len = len_a};
+	fill_positions(&pattern, ws->positions[0]);
+	fill_prefix_sets(&pattern);
+	int res = damerau_levenshtein_prepared(ws, &pattern, b, len_b, limit);
+	clear_positions(&pattern);
+	return res;
+}
+
+int damerau_levenshtein_distance_ws(DistanceWorkspace *ws, const char *a, const char *b)
+{
+	int len_a = strlen(a);
+	int len_b = strlen(b);
+	// The distance is never more than the longer string
+	return damerau_levenshtein_dispatch(ws, a, len_a, b, len_b, max(len_a, len_b));
+}
+
+// Same as damerau_levenshtein_distance_ws, but only exact up to limit and
+// limit + 1 for anything further
+int damerau_levenshtein_distance_bounded(DistanceWorkspace *ws, const char *a, const char *b, int limit)
+{
+	return damerau_levenshtein_dispatch(ws, a, strlen(a), b, strlen(b), limit);
+}
+
+// A query compared against every node of a tree walk. Its match masks and
+// character sets are built once up front instead of for every comparison
+typedef struct PreparedQuery
+{
+	PreparedString string;
+	uint64_t peq[UCHAR_MAX + 1];
+	uint32_t signature;
+	// Too long for the single word engine, goes through the regular dispatch
+	bool fallback;
+} PreparedQuery;
+
+void prepare_query(PreparedQuery *pq, const char *query)
+{
+	pq->string.text = query;
+	pq->string.len = strlen(query);
+	pq->fallback = pq->string.len > 64;
+	pq->signature = word_signature(query);
+	memset(pq->peq, 0, sizeof(pq->peq));
+	if (!pq->fallback)
+	{
+		fill_positions(&pq->string, pq->peq);
+		fill_prefix_sets(&pq->string);
+	}
+}
+
+// Distance from the prepared query to word if it's at most limit, limit + 1 if not
+int prepared_distance_bounded(DistanceWorkspace *ws, PreparedQuery *pq, const char *word, int limit)
+{
+	if (pq->fallback)
+	{
+		return damerau_levenshtein_distance_bounded(ws, pq->string.text, word, limit);
+	}
+	return damerau_levenshtein_prepared(ws, &pq->string, word, strlen(word), limit);
+}
+
+int prepared_distance(DistanceWorkspace *ws, PreparedQuery *pq, const char *word)
+{
+	if (pq->fallback)
+	{
+		return damerau_levenshtein_distance_ws(ws, pq->string.text, word);
+	}
+	int len = strlen(word);
+	return damerau_levenshtein_prepared(ws, &pq->string, word, len, max(pq->string.len, len));
+}
+
+// Number of words prepared_distance_batch compares against the query at once
+#define DISTANCE_BATCH 8
+// Longest query and words the batch kernels take, one bit per query character
+// in 32 bit lanes and the words transposed into a fixed size buffer
+#define BATCH_MAX_QUERY 32
+#define BATCH_MAX_WORD 64
+
+// Optimal string alignment distance from the pattern (match masks in peq) to
+// up to DISTANCE_BATCH words, one word per SIMD lane
+typedef void (*OsaBatchKernel)(const uint64_t *peq, int len_p, const char **words, const int *lens, int count, int *out);
+
+void osa_batch_scalar(const uint64_t *peq, int len_p, const char **words, const int *lens, int count, int *out)
+{
+	for (int i = 0; i < count; i++)
+	{
+		out[i] = osa_distance_word(peq, len_p, words[i], lens[i]);
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+// Lays the words out column by column so each step of the kernels loads the
+// next character of every word at once. Finished words read as '\0', which
+// never matches the query
+int transpose_batch(const char **words, const int *lens, int count, int32_t chars[BATCH_MAX_WORD][DISTANCE_BATCH], int32_t *lane_lens)
+{
+	int longest = 0;
+	for (int lane = 0; lane < DISTANCE_BATCH; lane++)
+	{
+		lane_lens[lane] = lane < count ? lens[lane] : 0;
+		longest = max(longest, lane_lens[lane]);
+	}
+	for (int t = 0; t < longest; t++)
+	{
+		for (int lane = 0; lane < DISTANCE_BATCH; lane++)
+		{
+			chars[t][lane] = t < lane_lens[lane] ? (unsigned char)words[lane][t] : 0;
+		}
+	}
+	return longest;
+}
+
+// osa_distance_word with all 8 words in the 32 bit lanes of one AVX2 register.
+// Lanes whose word has ended keep running but stop counting
+__attribute__((target("avx2"))) void osa_batch_avx2(const uint64_t *peq, int len_p, const char **words, const int *lens, int count, int *out)
+{
+	int32_t chars[BATCH_MAX_WORD][DISTANCE_BATCH];
+	int32_t lane_lens[DISTANCE_BATCH];
+	int longest = transpose_batch(words, lens, count, chars, lane_lens);
+	const __m256i ones = _mm256_set1_epi32(-1);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i last = _mm256_set1_epi32((int32_t)((uint32_t)1 << (len_p - 1)));
+	const __m256i lens_v = _mm256_loadu_si256((const __m256i *)lane_lens);
+	__m256i VP = ones;
+	__m256i VN = _mm256_setzero_si256();
+	__m256i D0 = _mm256_setzero_si256();
+	__m256i PM_old = _mm256_setzero_si256();
+	__m256i dist = _mm256_set1_epi32(len_p);
+	for (int t = 0; t < longest; t++)
+	{
+		// Low half of each 64 bit mask, the query is at most 32 characters
+		__m256i idx = _mm256_loadu_si256((const __m256i *)chars[t]);
+		__m256i PM = _mm256_i32gather_epi32((const int *)peq, idx, 8);
+		__m256i TR = _mm256_and_si256(_mm256_slli_epi32(_mm256_andnot_si256(D0, PM), 1), PM_old);
+		D0 = _mm256_or_si256(_mm256_xor_si256(_mm256_add_epi32(_mm256_and_si256(PM, VP), VP), VP),
+							 _mm256_or_si256(PM, _mm256_or_si256(VN, TR)));
+		__m256i HP = _mm256_or_si256(VN, _mm256_xor_si256(_mm256_or_si256(D0, VP), ones));
+		__m256i HN = _mm256_and_si256(D0, VP);
+		__m256i active = _mm256_cmpgt_epi32(lens_v, _mm256_set1_epi32(t));
+		// Compare masks are -1, so subtracting the HP one adds one
+		dist = _mm256_sub_epi32(dist, _mm256_and_si256(active, _mm256_cmpeq_epi32(_mm256_and_si256(HP, last), last)));
+		dist = _mm256_add_epi32(dist, _mm256_and_si256(active, _mm256_cmpeq_epi32(_mm256_and_si256(HN, last), last)));
+		HP = _mm256_or_si256(_mm256_slli_epi32(HP, 1), one);
+		HN = _mm256_slli_epi32(HN, 1);
+		VP = _mm256_or_si256(HN, _mm256_xor_si256(_mm256_or_si256(D0, HP), ones));
+		VN = _mm256_and_si256(HP, D0);
+		PM_old = PM;
+	}
+	int32_t res[DISTANCE_BATCH];
+	_mm256_storeu_si256((__m256i *)res, dist);
+	for (int i = 0; i < count; i++)
+	{
+		out[i] = res[i];
+	}
+}
+
+// Same as osa_batch_avx2 with two 4 lane SSE registers
+__attribute__((target("sse4.1"))) void osa_batch_sse41(const uint64_t *peq, int len_p, const char **words, const int *lens, int count, int *out)
+{
+	int32_t chars[BATCH_MAX_WORD][DISTANCE_BATCH];
+	int32_t lane_lens[DISTANCE_BATCH];
+	int longest = transpose_batch(words, lens, count, chars, lane_lens);
+	const __m128i ones = _mm_set1_epi32(-1);
+	const __m128i one = _mm_set1_epi32(1);
+	const __m128i last = _mm_set1_epi32((int32_t)((uint32_t)1 << (len_p - 1)));
+	int32_t res[DISTANCE_BATCH];
+	for (int half = 0; half < DISTANCE_BATCH; half += 4)
+	{
+		const __m128i lens_v = _mm_loadu_si128((const __m128i *)(lane_lens + half));
+		__m128i VP = ones;
+		__m128i VN = _mm_setzero_si128();
+		__m128i D0 = _mm_setzero_si128();
+		__m128i PM_old = _mm_setzero_si128();
+		__m128i dist = _mm_set1_epi32(len_p);
+		for (int t = 0; t < longest; t++)
+		{
+			const int32_t *c = chars[t] + half;
+			__m128i PM = _mm_setzero_si128();
+			PM = _mm_insert_epi32(PM, (int32_t)peq[c[0]], 0);
+			PM = _mm_insert_epi32(PM, (int32_t)peq[c[1]], 1);
+			PM = _mm_insert_epi32(PM, (int32_t)peq[c[2]], 2);
+			PM = _mm_insert_epi32(PM, (int32_t)peq[c[3]], 3);
+			__m128i TR = _mm_and_si128(_mm_slli_epi32(_mm_andnot_si128(D0, PM), 1), PM_old);
+			D0 = _mm_or_si128(_mm_xor_si128(_mm_add_epi32(_mm_and_si128(PM, VP), VP), VP),
+							  _mm_or_si128(PM, _mm_or_si128(VN, TR)));
+			__m128i HP = _mm_or_si128(VN, _mm_xor_si128(_mm_or_si128(D0, VP), ones));
+			__m128i HN = _mm_and_si128(D0, VP);
+			__m128i active = _mm_cmpgt_epi32(lens_v, _mm_set1_epi32(t));
+			dist = _mm_sub_epi32(dist, _mm_and_si128(active, _mm_cmpeq_epi32(_mm_and_si128(HP, last), last)));
+			dist = _mm_add_epi32(dist, _mm_and_si128(active, _mm_cmpeq_epi32(_mm_and_si128(HN, last), last)));
+			HP = _mm_or_si128(_mm_slli_epi32(HP, 1), one);
+			HN = _mm_slli_epi32(HN, 1);
+			VP = _mm_or_si128(HN, _mm_xor_si128(_mm_or_si128(D0, HP), ones));
+			VN = _mm_and_si128(HP, D0);
+			PM_old = PM;
+		}
+		_mm_storeu_si128((__m128i *)(res + half), dist);
+	}
+	for (int i = 0; i < count; i++)
+	{
+		out[i] = res[i];
+	}
+}
+#endif
+
+OsaBatchKernel osaBatchKernel = osa_batch_scalar;
+pthread_once_t osaBatchKernelOnce = PTHREAD_ONCE_INIT;
+
+// Picks the widest kernel the CPU supports, once per process
+void select_osa_batch_kernel(void)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		osaBatchKernel = osa_batch_avx2;
+	else if (__builtin_cpu_supports("sse4.1"))
+		osaBatchKernel = osa_batch_sse41;
+#endif
+}
+
+// prepared_distance_bounded for count (at most DISTANCE_BATCH) words, each
+// against its own limit. The bit-parallel part runs for all of them together
+void prepared_distance_batch(DistanceWorkspace *ws, PreparedQuery *pq, const char **words, const int *limits, int count, int *out)
+{
+	int lens[DISTANCE_BATCH];
+	bool fits = !pq->fallback && pq->string.len > 0 && pq->string.len <= BATCH_MAX_QUERY && count > 1;
+	for (int i = 0; i < count; i++)
+	{
+		lens[i] = strlen(words[i]);
+		fits = fits && lens[i] <= BATCH_MAX_WORD;
+	}
+	if (!fits)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			out[i] = prepared_distance_bounded(ws, pq, words[i], limits[i]);
+		}
+		return;
+	}
+	pthread_once(&osaBatchKernelOnce, select_osa_batch_kernel);
+	int osa[DISTANCE_BATCH];
+	osaBatchKernel(pq->peq, pq->string.len, words, lens, count, osa);
+	for (int i = 0; i < count; i++)
+	{
+		if (limits[i] < 0 || abs(pq->string.len - lens[i]) > limits[i])
+			out[i] = limits[i] + 1;
+		else if (lens[i] == 0)
+			out[i] = pq->string.len;
+		else
+			out[i] = damerau_levenshtein_from_osa(ws, &pq->string, words[i], lens[i], osa[i], limits[i]);
+	}
+}
+
+int damerau_levenshtein_distance(const char *a, const char *b)
+{
+	DistanceWorkspace ws;
+	init_workspace(&ws);
+	int res = damerau_levenshtein_distance_ws(&ws, a, b);
+	free_workspace(&ws);
+	return res;
+}
+
+void insert(WordTree *tree, char *word, DistanceWorkspace *ws)
+{
+	if (word == NULL || strlen(word) == 0)
+	{
+		return;
+	}
+	if (tree->count == 0)
+	{
+		createNode(tree, word);
+		return;
+	}
+
+	// The new word is compared against every node on the way down
+	PreparedQuery prepared;
+	prepare_query(&prepared, word);
+	uint32_t curr = ROOT_NODE;
+	while (curr != NO_NODE)
+	{
+		int distance = prepared_distance(ws, &prepared, node_word(tree, curr));
+		if (distance == 0)
+		{
+			return;
+		}
+		int index = distance % MAX_CHAR; // Hash the distance to find the child
+		uint32_t next = load_link(child_link(tree, curr, index));
+		if (next == NO_NODE || tree->nodes[next].distance != index)
+		{
+			add_child(tree, curr, createNode(tree, word), index);
+			return;
+		}
+		curr = next;
+	}
+}
+
+// Lets the filter bench turn the prefilter in expand_node off to compare
+bool prefilterEnabled = true;
+
+// Lower bound on the distance from the query to node's word without reading
+// the word: the difference in length, and the characters only one of them has
+int prefilter_bound(PreparedQuery *prepared, const Node *node)
+{
+	int bound = max(__builtin_popcount(prepared->signature & ~node->signature), __builtin_popcount(node->signature & ~prepared->signature));
+	if (node->length < UINT16_MAX)
+	{
+		bound = max(bound, abs(prepared->string.len - node->length));
+	}
+	return bound;
+}
+
+// Compares the children of node that could hold matches against the query and
+// writes the ones within reach to out. A node has at most one child per
+// distance, so out needs room for MAX_CHAR
+int expand_node(WordTree *tree, PreparedQuery *prepared, int radius, SearchItem item, DistanceWorkspace *ws, SearchItem *out)
+{
+	Node *curr = &tree->nodes[item.node];
+	int lower = fmax(item.distance - radius, 0);
+	int upper = min(item.distance + radius, max_distance(curr));
+	uint32_t batch[DISTANCE_BATCH];
+	const char *words[DISTANCE_BATCH];
+	int limits[DISTANCE_BATCH];
+	int distances[DISTANCE_BATCH];
+	// Children in range are compared against the query together
+	int found = 0;
+	int count = 0;
+	uint32_t child = load_link(child_link(tree, item.node, lower));
+	while (child != NO_NODE && tree->nodes[child].distance <= upper)
+	{
+		// Children the bound already puts out of reach skip the distance
+		int limit = radius + max_distance(&tree->nodes[child]);
+		if (!prefilterEnabled || prefilter_bound(prepared, &tree->nodes[child]) <= limit)
+		{
+			batch[count] = child;
+			words[count] = node_word(tree, child);
+			limits[count] = limit;
+			count++;
+		}
+		else
+		{
+			ws->filtered++;
+		}
+		child = load_link(&tree->nodes[child].nextSibling);
+		if (count > 0 && (count == DISTANCE_BATCH || child == NO_NODE || tree->nodes[child].distance > upper))
+		{
+			ws->computed += count;
+			prepared_distance_batch(ws, prepared, words, limits, count, distances);
+			for (int j = 0; j < count; j++)
+			{
+				if (distances[j] <= limits[j])
+				{
+					out[found++] = (SearchItem){batch[j], distances[j]};
+				}
+			}
+			count = 0;
+		}
+	}
+	return found;
+}
+
+// Fills results with up to max words out of the per distance buckets, closest
+// first, and empties the buckets
+void collect_results(CharStack *potential, int radius, int max, CharStack *results)
+{
+	results->len = 0;
+	for (int d = 0; d <= radius; d++)
+	{
+		for (int i = 0; i < potential[d].len && results->len < max; i++)
+		{
+			push_char(results, potential[d].words[i]);
+		}
+		potential[d].len = 0;
+	}
+}
+
+// Function to search for words within a given radius in the BK-Tree. results
+// is replaced with the matches, closest first
+void search(WordTree *tree, char *query, int radius, int max, DistanceWorkspace *ws, CharStack *results)
+{
+	results->len = 0;
+	if (tree_count(tree) == 0)
+	{
+		return;
+	}
+	PreparedQuery prepared;
+	prepare_query(&prepared, query);
+	// Past radius + maxDistance a node is neither a match nor has children in
+	// range. Nodes only go on the stack once they're known to be within that
+	int limit = radius + max_distance(&tree->nodes[ROOT_NODE]);
+	int rootDistance = prepared_distance_bounded(ws, &prepared, node_word(tree, ROOT_NODE), limit);
+	if (rootDistance > limit)
+	{
+		return;
+	}
+	NodeStack *stack = &ws->stack;
+	CharStack *potential = reserve_potential(ws, radius);
+	stack->count = 0;
+	push_node(stack, ROOT_NODE, rootDistance);
+	SearchItem children[MAX_CHAR];
+	while (stack->count > 0)
+	{
+		SearchItem item;
+		item.node = pop_node(stack, &item.distance);
+		if (item.distance <= radius)
+		{
+			push_char(&potential[item.distance], node_word(tree, item.node));
+		}
+		int count = expand_node(tree, &prepared, radius, item, ws, children);
+		for (int j = 0; j < count; j++)
+		{
+			push_node(stack, children[j].node, children[j].distance);
+		}
+	}
+	collect_results(potential, radius, max, results);
+}
+
+// How many words the GUI's closest search asks for
+#define NEAREST_COUNT 10
+
+// A subtree waiting in search_nearest. Nothing under it is closer to the query
+// than bound
+typedef struct NearestItem
+{
+	SearchItem item;
+	int bound;
+} NearestItem;
+
+// Frontier of search_nearest, a min-heap on bound
+void push_frontier(NearestItem **heap, int *count, int *capacity, NearestItem item)
+{
+	if (*count == *capacity)
+	{
+		*capacity = *capacity == 0 ? 64 : *capacity * 2;
+		*heap = realloc(*heap, *capacity * sizeof(NearestItem));
+	}
+	int i = (*count)++;
+	while (i > 0 && (*heap)[(i - 1) / 2].bound > item.bound)
+	{
+		(*heap)[i] = (*heap)[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	(*heap)[i] = item;
+}
+
+NearestItem pop_frontier(NearestItem *heap, int *count)
+{
+	NearestItem top = heap[0];
+	NearestItem last = heap[--*count];
+	int i = 0;
+	while (2 * i + 1 < *count)
+	{
+		int child = 2 * i + 1;
+		if (child + 1 < *count && heap[child + 1].bound < heap[child].bound)
+			child++;
+		if (heap[child].bound >= last.bound)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+	return top;
+}
+
+// Best k matches so far, a max-heap on distance so the worst one is on top
+void sift_down_matches(SearchItem *matches, int count, int i)
+{
+	SearchItem item = matches[i];
+	while (2 * i + 1 < count)
+	{
+		int child = 2 * i + 1;
+		if (child + 1 < count && matches[child + 1].distance > matches[child].distance)
+			child++;
+		if (matches[child].distance <= item.distance)
+			break;
+		matches[i] = matches[child];
+		i = child;
+	}
+	matches[i] = item;
+}
+
+// Adds a match if it's among the best k and returns the largest distance a
+// new match can still have
+int add_match(SearchItem *matches, int *count, int k, SearchItem match, int limit)
+{
+	if (*count < k)
+	{
+		int i = (*count)++;
+		while (i > 0 && matches[(i - 1) / 2].distance < match.distance)
+		{
+			matches[i] = matches[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		matches[i] = match;
+	}
+	else if (match.distance < matches[0].distance)
+	{
+		matches[0] = match;
+		sift_down_matches(matches, *count, 0);
+	}
+	// Once there are k, only something closer than the worst of them helps
+	if (*count == k)
+		limit = min(limit, matches[0].distance - 1);
+	return limit;
+}
+
+// The k words closest to the query, at most radius away, closest first. It
+// goes through the subtrees that could hold the closest words first and the
+// radius shrinks to the worst of the k found so far, so it stops as soon as
+// nothing left can beat them. Ties at the last distance are cut arbitrarily
+void search_nearest(WordTree *tree, char *query, int k, int radius, DistanceWorkspace *ws, CharStack *results)
+{
+	results->len = 0;
+	if (tree_count(tree) == 0 || k <= 0 || radius < 0)
+	{
+		return;
+	}
+	PreparedQuery prepared;
+	prepare_query(&prepared, query);
+	int limit = radius;
+	Node *root = &tree->nodes[ROOT_NODE];
+	int rootDistance = prepared_distance_bounded(ws, &prepared, node_word(tree, ROOT_NODE), limit + max_distance(root));
+	if (rootDistance > limit + max_distance(root))
+	{
+		return;
+	}
+	SearchItem *matches = malloc(k * sizeof(SearchItem));
+	int matchCount = 0;
+	NearestItem *frontier = NULL;
+	int frontierCount = 0, frontierCapacity = 0;
+	if (rootDistance <= limit)
+		limit = add_match(matches, &matchCount, k, (SearchItem){ROOT_NODE, rootDistance}, limit);
+	push_frontier(&frontier, &frontierCount, &frontierCapacity, (NearestItem){{ROOT_NODE, rootDistance}, max(rootDistance - max_distance(root), 0)});
+	SearchItem children[MAX_CHAR];
+	while (frontierCount > 0 && limit >= 0)
+	{
+		NearestItem next = pop_frontier(frontier, &frontierCount);
+		if (next.bound > limit)
+		{
+			break;
+		}
+		int count = expand_node(tree, &prepared, limit, next.item, ws, children);
+		for (int i = 0; i < count; i++)
+		{
+			Node *child = &tree->nodes[children[i].node];
+			if (children[i].distance <= limit)
+				limit = add_match(matches, &matchCount, k, children[i], limit);
+			// Everything under child is child->distance from the parent word
+			int bound = max(abs(next.item.distance - child->distance), children[i].distance - max_distance(child));
+			if (bound <= limit)
+				push_frontier(&frontier, &frontierCount, &frontierCapacity, (NearestItem){children[i], bound});
+		}
+	}
+	// Taking the worst off the top fills the results back to front
+	for (int i = matchCount - 1; i >= 0; i--)
+	{
+		push_char(results, NULL);
+	}
+	for (int i = matchCount - 1; i >= 0; i--)
+	{
+		results->words[i] = node_word(tree, matches[0].node);
+		matches[0] = matches[i];
+		sift_down_matches(matches, i, 0);
+	}
+	free(frontier);
+	free(matches);
+}
+
+// Gets each match from search_stream, closest first. Returning false stops the
+// search
+typedef bool (*SearchCallback)(char *word, int distance, void *data);
+
+// Hands a bucket's words to found, false once it's had enough or asked to stop
+bool flush_bucket(CharStack *bucket, int distance, int *left, SearchCallback found, void *data)
+{
+	for (int i = 0; i < bucket->len; i++)
+	{
+		if (*left == 0 || !found(bucket->words[i], distance, data))
+			return false;
+		(*left)--;
+	}
+	bucket->len = 0;
+	return *left > 0;
+}
+
+// search that hands the matches to found as it goes. Subtrees are gone through
+// in order of the lower bound on their distance like search_nearest, so once
+// the lowest bound left is past d every word at d has been seen and they go
+// out right away, at most limit of them. The closest words show up long
+// before a large radius is done. Setting kill stops it, even while nothing
+// is being found
+void search_stream(WordTree *tree, char *query, int radius, int limit, DistanceWorkspace *ws, SearchCallback found, void *data, bool *kill)
+{
+	if (tree_count(tree) == 0 || radius < 0 || limit <= 0)
+	{
+		return;
+	}
+	PreparedQuery prepared;
+	prepare_query(&prepared, query);
+	Node *root = &tree->nodes[ROOT_NODE];
+	int rootDistance = prepared_distance_bounded(ws, &prepared, node_word(tree, ROOT_NODE), radius + max_distance(root));
+	if (rootDistance > radius + max_distance(root))
+	{
+		return;
+	}
+	CharStack *potential = reserve_potential(ws, radius);
+	NearestItem *frontier = NULL;
+	int frontierCount = 0, frontierCapacity = 0;
+	if (rootDistance <= radius)
+		push_char(&potential[rootDistance], node_word(tree, ROOT_NODE));
+	push_frontier(&frontier, &frontierCount, &frontierCapacity, (NearestItem){{ROOT_NODE, rootDistance}, max(rootDistance - max_distance(root), 0)});
+	// Next distance to hand out
+	int next = 0;
+	int left = limit;
+	bool going = true;
+	SearchItem children[MAX_CHAR];
+	while (going && frontierCount > 0)
+	{
+		while (going && next <= radius && next < frontier[0].bound)
+		{
+			going = flush_bucket(&potential[next], next, &left, found, data);
+			next++;
+		}
+		going = going && !__atomic_load_n(kill, __ATOMIC_RELAXED);
+		if (!going)
+			break;
+		NearestItem item = pop_frontier(frontier, &frontierCount);
+		int count = expand_node(tree, &prepared, radius, item.item, ws, children);
+		for (int i = 0; i < count; i++)
+		{
+			Node *child = &tree->nodes[children[i].node];
+			if (children[i].distance <= radius)
+				push_char(&potential[children[i].distance], node_word(tree, children[i].node));
+			int bound = max(abs(item.item.distance - child->distance), children[i].distance - max_distance(child));
+			if (bound <= radius)
+				push_frontier(&frontier, &frontierCount, &frontierCapacity, (NearestItem){children[i], bound});
+		}
+	}
+	for (; going && next <= radius; next++)
+	{
+		going = flush_bucket(&potential[next], next, &left, found, data);
+	}
+	// Left over when stopped early
+	for (int d = 0; d <= radius; d++)
+	{
+		potential[d].len = 0;
+	}
+	free(frontier);
+}
+
+// A search_stream running on its own thread for the GUI, which picks up what
+// has been found so far every frame
+typedef struct StreamingSearch
+{
+	WordTree *tree;
+	char query[128];
+	int radius;
+	pthread_mutex_t lock;
+	// Matches the GUI hasn't taken yet
+	CharStack found;
+	bool done;
+	bool kill;
+} StreamingSearch;
+
+// The GUI lists the words as they come, already closest first
+bool stream_found(char *word, int distance, void *data)
+{
+	(void)distance;
+	StreamingSearch *stream = data;
+	pthread_mutex_lock(&stream->lock);
+	push_char(&stream->found, word);
+	pthread_mutex_unlock(&stream->lock);
+	return !__atomic_load_n(&stream->kill, __ATOMIC_RELAXED);
+}
+
+void *stream_search(void *args)
+{
+	StreamingSearch *stream = args;
+	DistanceWorkspace ws;
+	init_workspace(&ws);
+	search_stream(stream->tree, stream->query, stream->radius, INT_MAX, &ws, stream_found, stream, &stream->kill);
+	free_workspace(&ws);
+	__atomic_store_n(&stream->done, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+// Stops the streaming search if one's running and drops what it found
+void stop_stream(StreamingSearch *stream, pthread_t thread, bool *running)
+{
+	if (!*running)
+	{
+		return;
+	}
+	__atomic_store_n(&stream->kill, true, __ATOMIC_RELAXED);
+	pthread_join(thread, NULL);
+	stream->found.len = 0;
+	*running = false;
+}
+
+// Queries a search_batch worker takes at once
+#define SEARCH_BATCH_GROUP 16
+
+typedef struct SearchBatch
+{
+	WordTree *tree;
+	char **queries;
+	// The queries to search for, one of each text
+	int *order;
+	int count;
+	int radius;
+	int max;
+	CharStack *results;
+	// Next group to hand out
+	int nextGroup;
+} SearchBatch;
+
+// Sort key for search_batch, repeats of a query end up next to each other
+typedef struct BatchQuery
+{
+	const char *text;
+	int query;
+} BatchQuery;
+
+int compare_batch_queries(const void *a, const void *b)
+{
+	const BatchQuery *x = a, *y = b;
+	int text = strcmp(x->text, y->text);
+	return text != 0 ? text : x->query - y->query;
+}
+
+void *search_batch_worker(void *args)
+{
+	SearchBatch *batch = args;
+	DistanceWorkspace ws;
+	init_workspace(&ws);
+	int start;
+	while ((start = __atomic_fetch_add(&batch->nextGroup, 1, __ATOMIC_RELAXED) * SEARCH_BATCH_GROUP) < batch->count)
+	{
+		for (int i = start; i < min(start + SEARCH_BATCH_GROUP, batch->count); i++)
+		{
+			int q = batch->order[i];
+			search(batch->tree, batch->queries[q], batch->radius, batch->max, &ws, &batch->results[q]);
+		}
+	}
+	free_workspace(&ws);
+	return NULL;
+}
+
+// Runs count queries on threads threads (including the calling one) and
+// fills results[i] with what search would for queries[i]. Repeats of a query
+// are only searched for once. Walking the tree once for a group of queries
+// was tried, but only the node loads are shared, every query still needs its
+// own distances, and keeping track of which queries reached which node made
+// it slower than searching for them one by one
+void search_batch(WordTree *tree, char **queries, int count, int radius, int max, int threads, CharStack *results)
+{
+	for (int i = 0; i < count; i++)
+	{
+		results[i].len = 0;
+	}
+	if (tree_count(tree) == 0 || count <= 0)
+	{
+		return;
+	}
+	SearchBatch batch = {.tree = tree, .queries = queries, .radius = radius, .max = max, .results = results};
+	batch.order = malloc(count * sizeof(int));
+	BatchQuery *sorted = malloc(count * sizeof(BatchQuery));
+	for (int i = 0; i < count; i++)
+	{
+		sorted[i] = (BatchQuery){queries[i], i};
+	}
+	qsort(sorted, count, sizeof(BatchQuery), compare_batch_queries);
+	for (int i = 0; i < count; i++)
+	{
+		if (i == 0 || strcmp(sorted[i].text, sorted[i - 1].text) != 0)
+			batch.order[batch.count++] = sorted[i].query;
+	}
+	// No more threads than groups
+	threads = min(threads, (batch.count + SEARCH_BATCH_GROUP - 1) / SEARCH_BATCH_GROUP);
+	if (threads < 1)
+		threads = 1;
+	pthread_t *helpers = malloc(threads * sizeof(pthread_t));
+	for (int i = 1; i < threads; i++)
+	{
+		pthread_create(&helpers[i], NULL, search_batch_worker, &batch);
+	}
+	search_batch_worker(&batch);
+	for (int i = 1; i < threads; i++)
+	{
+		pthread_join(helpers[i], NULL);
+	}
+	// Repeats get a copy of the first one's results
+	for (int i = 1; i < count; i++)
+	{
+		if (strcmp(sorted[i].text, sorted[i - 1].text) != 0)
+			continue;
+		CharStack *first = &results[sorted[i - 1].query];
+		for (int j = 0; j < first->len; j++)
+			push_char(&results[sorted[i].query], first->words[j]);
+	}
+	free(sorted);
+	free(helpers);
+	free(batch.order);
+}
+
+// Radius from which the GUI spreads a search over all cores, below it the
+// frontier stays small and threads cost more than they save
+#define PARALLEL_SEARCH_RADIUS 3
+// Default for how many nodes a search worker takes off a deque at once
+#define SEARCH_GRAIN 32
+
+// One search worker's nodes. The owner pushes and pops at the bottom, idle
+// workers steal from the top where the nodes closest to the root, and so the
+// biggest subtrees, are
+typedef struct SearchDeque
+{
+	SearchItem *items;
+	size_t top;
+	size_t bottom;
+	size_t capacity;
+	pthread_mutex_t lock;
+} SearchDeque;
+
+typedef struct ParallelSearch
+{
+	WordTree *tree;
+	PreparedQuery prepared;
+	int radius;
+	int grain;
+	int threads;
+	SearchDeque *deques;
+	// Nodes pushed but not expanded yet, the workers stop when it hits 0
+	size_t pending;
+	// Every worker fills its own radius + 1 buckets, they're merged at the end
+	CharStack *potential;
+} ParallelSearch;
+
+typedef struct SearchWorker
+{
+	ParallelSearch *search;
+	int id;
+} SearchWorker;
+
+void push_search_items(SearchDeque *deque, const SearchItem *items, int count)
+{
+	pthread_mutex_lock(&deque->lock);
+	if (deque->bottom + count > deque->capacity)
+	{
+		// Move the rest down over what was stolen before growing
+		memmove(deque->items, deque->items + deque->top, (deque->bottom - deque->top) * sizeof(SearchItem));
+		deque->bottom -= deque->top;
+		deque->top = 0;
+		while (deque->bottom + count > deque->capacity)
+		{
+			deque->capacity = deque->capacity == 0 ? 256 : deque->capacity * 2;
+			deque->items = realloc(deque->items, deque->capacity * sizeof(SearchItem));
+		}
+	}
+	memcpy(deque->items + deque->bottom, items, count * sizeof(SearchItem));
+	deque->bottom += count;
+	pthread_mutex_unlock(&deque->lock);
+}
+
+// Takes up to count of the newest nodes
+int pop_search_items(SearchDeque *deque, SearchItem *out, int count)
+{
+	pthread_mutex_lock(&deque->lock);
+	int taken = min(count, deque->bottom - deque->top);
+	deque->bottom -= taken;
+	memcpy(out, deque->items + deque->bottom, taken * sizeof(SearchItem));
+	pthread_mutex_unlock(&deque->lock);
+	return taken;
+}
+
+// Takes half of the oldest nodes, at most count
+int steal_search_items(SearchDeque *deque, SearchItem *out, int count)
+{
+	pthread_mutex_lock(&deque->lock);
+	int size = deque->bottom - deque->top;
+	int taken = min(count, (size + 1) / 2);
+	memcpy(out, deque->items + deque->top, taken * sizeof(SearchItem));
+	deque->top += taken;
+	pthread_mutex_unlock(&deque->lock);
+	return taken;
+}
+
+void *search_worker(void *args)
+{
+	SearchWorker *worker = args;
+	ParallelSearch *search = worker->search;
+	SearchDeque *own = &search->deques[worker->id];
+	CharStack *potential = search->potential + worker->id * (search->radius + 1);
+	DistanceWorkspace ws;
+	init_workspace(&ws);
+	SearchItem *work = malloc(search->grain * sizeof(SearchItem));
+	SearchItem children[MAX_CHAR];
+	while (__atomic_load_n(&search->pending, __ATOMIC_ACQUIRE) > 0)
+	{
+		int count = pop_search_items(own, work, search->grain);
+		for (int i = 1; i < search->threads && count == 0; i++)
+		{
+			count = steal_search_items(&search->deques[(worker->id + i) % search->threads], work, search->grain);
+		}
+		if (count == 0)
+		{
+			// Everything left is being expanded by someone else
+			sched_yield();
+			continue;
+		}
+		for (int i = 0; i < count; i++)
+		{
+			if (work[i].distance <= search->radius)
+			{
+				push_char(&potential[work[i].distance], node_word(search->tree, work[i].node));
+			}
+			int found = expand_node(search->tree, &search->prepared, search->radius, work[i], &ws, children);
+			// Counted before this node is let go of, so pending can't hit 0 early
+			if (found > 0)
+			{
+				__atomic_add_fetch(&search->pending, found, __ATOMIC_RELAXED);
+				push_search_items(own, children, found);
+			}
+			__atomic_sub_fetch(&search->pending, 1, __ATOMIC_RELEASE);
+		}
+	}
+	free(work);
+	free_workspace(&ws);
+	return NULL;
+}
+
+// search spread over threads threads (including the calling one), which
+// trade nodes with each other as they run out. grain is how many nodes a
+// worker takes off a deque at once, smaller balances better and locks more.
+// Words at the same distance can come back in a different order than search.
+// The top of the tree is gone through on the calling thread until there are
+// threads * grain nodes to share, so searches that never get that wide don't
+// start any threads at all
+void search_parallel(WordTree *tree, char *query, int radius, int max, int threads, int grain, CharStack *results)
+{
+	results->len = 0;
+	if (tree_count(tree) == 0)
+	{
+		return;
+	}
+	DistanceWorkspace ws;
+	init_workspace(&ws);
+	if (threads <= 1)
+	{
+		search(tree, query, radius, max, &ws, results);
+		free_workspace(&ws);
+		return;
+	}
+	ParallelSearch search = {.tree = tree, .radius = radius, .grain = grain > 0 ? grain : 1, .threads = threads};
+	prepare_query(&search.prepared, query);
+	int limit = radius + max_distance(&tree->nodes[ROOT_NODE]);
+	int rootDistance = prepared_distance_bounded(&ws, &search.prepared, node_word(tree, ROOT_NODE), limit);
+	if (rootDistance > limit)
+	{
+		free_workspace(&ws);
+		return;
+	}
+	search.potential = calloc(search.threads * (radius + 1), sizeof(CharStack));
+	// Nodes from the front of frontier are expanded here, matches go in the
+	// calling thread's buckets
+	size_t frontierCapacity = 256, frontierCount = 0, next = 0;
+	SearchItem *frontier = malloc(frontierCapacity * sizeof(SearchItem));
+	frontier[frontierCount++] = (SearchItem){ROOT_NODE, rootDistance};
+	SearchItem children[MAX_CHAR];
+	size_t wide = (size_t)search.threads * search.grain;
+	while (next < frontierCount && frontierCount - next < wide)
+	{
+		SearchItem item = frontier[next++];
+		if (item.distance <= radius)
+		{
+			push_char(&search.potential[item.distance], node_word(tree, item.node));
+		}
+		int found = expand_node(tree, &search.prepared, radius, item, &ws, children);
+		if (frontierCount + found > frontierCapacity)
+		{
+			// At most MAX_CHAR children, doubling is always enough
+			frontierCapacity *= 2;
+			frontier = realloc(frontier, frontierCapacity * sizeof(SearchItem));
+		}
+		memcpy(frontier + frontierCount, children, found * sizeof(SearchItem));
+		frontierCount += found;
+	}
+	free_workspace(&ws);
+	search.deques = calloc(search.threads, sizeof(SearchDeque));
+	SearchWorker *workers = malloc(search.threads * sizeof(SearchWorker));
+	for (int i = 0; i < search.threads; i++)
+	{
+		pthread_mutex_init(&search.deques[i].lock, NULL);
+		workers[i] = (SearchWorker){&search, i};
+	}
+	pthread_t *helpers = malloc(search.threads * sizeof(pthread_t));
+	if (next < frontierCount)
+	{
+		push_search_items(&search.deques[0], frontier + next, frontierCount - next);
+		search.pending = frontierCount - next;
+		for (int i = 1; i < search.threads; i++)
+		{
+			pthread_create(&helpers[i], NULL, search_worker, &workers[i]);
+		}
+		search_worker(&workers[0]);
+		for (int i = 1; i < search.threads; i++)
+		{
+			pthread_join(helpers[i], NULL);
+		}
+	}
+	free(frontier);
+	// Every worker's bucket for a distance before the next distance
+	for (int d = 0; d <= radius; d++)
+	{
+		for (int i = 0; i < search.threads; i++)
+		{
+			CharStack *bucket = &search.potential[i * (radius + 1) + d];
+			for (int j = 0; j < bucket->len && results->len < max; j++)
+			{
+				push_char(results, bucket->words[j]);
+			}
+		}
+	}
+	for (int i = 0; i < search.threads; i++)
+	{
+		pthread_mutex_destroy(&search.deques[i].lock);
+		free(search.deques[i].items);
+	}
+	free(helpers);
+	free(workers);
+	for (int i = 0; i < search.threads * (radius + 1); i++)
+	{
+		free_chars(&search.potential[i]);
+	}
+	free(search.potential);
+	free(search.deques);
+}
+
+// Prefix tree over the word tree's words, for searching while the query is
+// typed. For small radii it only has to look at the few branches that stay
+// close to the query, where the BK-tree compares against a lot of words
+typedef struct TrieNode
+{
+	// Offset of the word ending here in the word tree's pool, or NO_NODE
+	uint32_t word;
+	uint32_t firstChild;
+	uint32_t nextSibling;
+	// Children are sorted by it
+	unsigned char c;
+} TrieNode;
+
+typedef struct WordTrie
+{
+	TrieNode *nodes;
+	uint32_t count;
+	uint32_t capacity;
+	// Length of the longest word
+	int depth;
+	// The tree the words come from
+	WordTree *tree;
+} WordTrie;
+
+void init_trie(WordTrie *trie)
+{
+	*trie = (WordTrie){0};
+}
+
+void free_trie(WordTrie *trie)
+{
+	free(trie->nodes);
+	init_trie(trie);
+}
+
+uint32_t create_trie_node(WordTrie *trie, unsigned char c)
+{
+	if (trie->count == trie->capacity)
+	{
+		trie->capacity = trie->capacity == 0 ? 1024 : trie->capacity * 2;
+		trie->nodes = realloc(trie->nodes, trie->capacity * sizeof(TrieNode));
+	}
+	trie->nodes[trie->count] = (TrieNode){.word = NO_NODE, .firstChild = NO_NODE, .nextSibling = NO_NODE, .c = c};
+	return trie->count++;
+}
+
+// Builds the trie over every word of tree, which has to stay as it is while
+// the trie is used
+void build_trie(WordTrie *trie, WordTree *tree)
+{
+	free_trie(trie);
+	trie->tree = tree;
+	create_trie_node(trie, 0);
+	for (uint32_t i = 0; i < tree->count; i++)
+	{
+		const unsigned char *word = (const unsigned char *)node_word(tree, i);
+		uint32_t curr = 0;
+		int depth = 0;
+		for (; word[depth]; depth++)
+		{
+			// Find the child for the character, or the sibling it would go
+			// after (NO_NODE for the front of the list)
+			uint32_t previous = NO_NODE;
+			uint32_t next = trie->nodes[curr].firstChild;
+			while (next != NO_NODE && trie->nodes[next].c < word[depth])
+			{
+				previous = next;
+				next = trie->nodes[next].nextSibling;
+			}
+			if (next == NO_NODE || trie->nodes[next].c != word[depth])
+			{
+				// create_trie_node can move the nodes, so only indices are
+				// kept across it
+				uint32_t child = create_trie_node(trie, word[depth]);
+				trie->nodes[child].nextSibling = next;
+				if (previous == NO_NODE)
+					trie->nodes[curr].firstChild = child;
+				else
+					trie->nodes[previous].nextSibling = child;
+				next = child;
+			}
+			curr = next;
+		}
+		trie->nodes[curr].word = tree->nodes[i].word;
+		trie->depth = max(trie->depth, depth);
+	}
+}
+
+typedef struct TrieSearch
+{
+	const WordTrie *trie;
+	const char *query;
+	int len;
+	int radius;
+	// One DP row per depth on the current path, after a row of sentinels.
+	// Each has a sentinel and then the distances to every query prefix
+	int *rows;
+	int cols;
+	int far;
+	// Deepest row on the path holding each character
+	int *da;
+	CharStack *potential;
+} TrieSearch;
+
+// Fills the row for node, at depth rows into the path, and goes on to its
+// children while something under it can still be within the radius. carry is
+// the lowest any later row can get by transposing back to an earlier one
+void search_trie_node(TrieSearch *search, uint32_t node, int depth, int carry)
+{
+	const TrieNode *curr = &search->trie->nodes[node];
+	int cols = search->cols;
+	int *row = search->rows + (depth + 1) * cols;
+	int *up = row - cols;
+	// The same recurrence as damerau_levenshtein_distance_dp with the word
+	// down the rows
+	row[0] = search->far;
+	row[1] = depth;
+	int rowMin = depth;
+	int db = 0;
+	for (int j = 1; j <= search->len; j++)
+	{
+		unsigned char q = search->query[j - 1];
+		int k = search->da[q];
+		int l = db;
+		int cost = curr->c == q ? 0 : 1;
+		if (cost == 0)
+			db = j;
+		row[j + 1] = min4(up[j] + cost, row[j] + 1, up[j + 1] + 1, search->rows[k * cols + l] + (depth - k - 1) + 1 + (j - l - 1));
+		rowMin = min(rowMin, row[j + 1]);
+	}
+	if (curr->word != NO_NODE && row[search->len + 1] <= search->radius)
+	{
+		push_char(&search->potential[row[search->len + 1]], search->trie->tree->words + curr->word);
+	}
+	if (min(rowMin, carry) > search->radius)
+	{
+		return;
+	}
+	int saved = search->da[curr->c];
+	search->da[curr->c] = depth;
+	for (uint32_t child = curr->firstChild; child != NO_NODE; child = search->trie->nodes[child].nextSibling)
+	{
+		search_trie_node(search, child, depth + 1, min(carry, rowMin) + 1);
+	}
+	search->da[curr->c] = saved;
+}
+
+// Same results as search, from the trie. Fast enough to run on every keystroke
+// for small radii
+void search_trie(WordTrie *trie, char *query, int radius, int max, DistanceWorkspace *ws, CharStack *results)
+{
+	results->len = 0;
+	if (trie->count == 0 || radius < 0)
+	{
+		return;
+	}
+	TrieSearch search = {.trie = trie, .query = query, .len = strlen(query), .radius = radius, .da = ws->da};
+	search.cols = search.len + 2;
+	search.far = trie->depth + search.len + 1;
+	search.rows = reserve_workspace(ws, trie->depth + 2, search.cols);
+	search.potential = reserve_potential(ws, radius);
+	// The sentinel row and the empty word's row, both stay put
+	for (int j = 0; j < search.cols; j++)
+	{
+		search.rows[j] = search.far;
+		search.rows[search.cols + j] = j - 1;
+	}
+	search.rows[search.cols] = search.far;
+	if (trie->nodes[0].word != NO_NODE && search.len <= radius)
+	{
+		push_char(&search.potential[search.len], trie->tree->words + trie->nodes[0].word);
+	}
+	for (uint32_t child = trie->nodes[0].firstChild; child != NO_NODE; child = trie->nodes[child].nextSibling)
+	{
+		search_trie_node(&search, child, 1, 1);
+	}
+	collect_results(search.potential, radius, max, results);
+}
+
+// Only this much of each word goes into the deletes index, anything past it
+// is left to the distance check
+#define DELETE_PREFIX 7
+// Largest radius a deletes index can be built for, and the one the GUI uses
+#define DELETE_MAX_DISTANCE 3
+#define DELETE_INDEX_DISTANCE 2
+// Deletes of a DELETE_PREFIX long string, up to DELETE_MAX_DISTANCE of them
+#define MAX_DELETES 64
+
+// Index of every word under the strings left after deleting up to distance
+// characters from its prefix. Two words within distance of each other always
+// share one of those, so a search only looks at the words filed under the
+// query's own deletes. A hash table of word lists, the lists back to back
+typedef struct DeleteIndex
+{
+	// Where each bucket's words start in entries, with the end after the last
+	uint32_t *starts;
+	// Node indexes into the word tree
+	uint32_t *entries;
+	uint32_t mask;
+	size_t count;
+	int distance;
+	// Query number each word was last checked for, so it's only checked once.
+	// A search changes these, so only one can run on an index at a time
+	uint32_t *seen;
+	uint32_t stamp;
+	// The tree the words come from
+	WordTree *tree;
+} DeleteIndex;
+
+void init_delete_index(DeleteIndex *index)
+{
+	*index = (DeleteIndex){0};
+}
+
+void free_delete_index(DeleteIndex *index)
+{
+	free(index->starts);
+	free(index->entries);
+	free(index->seen);
+	init_delete_index(index);
+}
+
+uint32_t hash_chars(const char *s, int len)
+{
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < len; i++)
+	{
+		hash = (hash ^ (unsigned char)s[i]) * 16777619u;
+	}
+	return hash;
+}
+
+// Adds the hashes of text and of everything made by deleting up to left more
+// of its characters at from or after to hashes, returns the new count
+int add_deletes(char *text, int len, int from, int left, uint32_t *hashes, int count)
+{
+	hashes[count++] = hash_chars(text, len);
+	if (left == 0)
+	{
+		return count;
+	}
+	for (int i = from; i < len; i++)
+	{
+		char removed = text[i];
+		memmove(text + i, text + i + 1, len - i - 1);
+		count = add_deletes(text, len - 1, i, left - 1, hashes, count);
+		memmove(text + i + 1, text + i, len - i - 1);
+		text[i] = removed;
+	}
+	return count;
+}
+
+// Hashes of the deletes of word's prefix, each once. Letters that repeat give
+// the same delete more than once
+int word_deletes(const char *word, int distance, uint32_t *hashes)
+{
+	char prefix[DELETE_PREFIX];
+	int len = 0;
+	while (len < DELETE_PREFIX && word[len])
+	{
+		prefix[len] = word[len];
+		len++;
+	}
+	int count = add_deletes(prefix, len, 0, distance, hashes, 0);
+	for (int i = 1; i < count; i++)
+	{
+		uint32_t hash = hashes[i];
+		int j = i;
+		for (; j > 0 && hashes[j - 1] > hash; j--)
+			hashes[j] = hashes[j - 1];
+		hashes[j] = hash;
+	}
+	int unique = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (unique == 0 || hashes[unique - 1] != hashes[i])
+			hashes[unique++] = hashes[i];
+	}
+	return unique;
+}
+
+// Builds the index over every word of tree for searches up to distance, which
+// has to stay as it is while the index is used
+void build_delete_index(DeleteIndex *index, WordTree *tree, int distance)
+{
+	free_delete_index(index);
+	index->tree = tree;
+	index->distance = min(distance, DELETE_MAX_DISTANCE);
+	uint32_t hashes[MAX_DELETES];
+	for (uint32_t i = 0; i < tree->count; i++)
+	{
+		index->count += word_deletes(node_word(tree, i), index->distance, hashes);
+	}
+	// About two words a bucket, words that only share a bucket are weeded out
+	// by the distance check anyway
+	uint32_t buckets = 1;
+	while (buckets < index->count / 2)
+		buckets *= 2;
+	index->mask = buckets - 1;
+	index->starts = calloc(buckets + 1, sizeof(uint32_t));
+	index->entries = malloc(index->count * sizeof(uint32_t));
+	index->seen = calloc(tree->count, sizeof(uint32_t));
+	for (uint32_t i = 0; i < tree->count; i++)
+	{
+		int count = word_deletes(node_word(tree, i), index->distance, hashes);
+		for (int j = 0; j < count; j++)
+			index->starts[hashes[j] & index->mask]++;
+	}
+	// Ends of the buckets, which filling them in backwards turns into starts
+	uint32_t end = 0;
+	for (uint32_t b = 0; b < buckets; b++)
+	{
+		end += index->starts[b];
+		index->starts[b] = end;
+	}
+	index->starts[buckets] = end;
+	for (uint32_t i = tree->count; i-- > 0;)
+	{
+		int count = word_deletes(node_word(tree, i), index->distance, hashes);
+		for (int j = 0; j < count; j++)
+			index->entries[--index->starts[hashes[j] & index->mask]] = i;
+	}
+}
+
+// Same results as search, from the deletes index. Radii the index wasn't
+// built for go to search
+void search_deletes(DeleteIndex *index, char *query, int radius, int max, DistanceWorkspace *ws, CharStack *results)
+{
+	results->len = 0;
+	if (index->entries == NULL || radius < 0)
+	{
+		return;
+	}
+	if (radius > index->distance)
+	{
+		search(index->tree, query, radius, max, ws, results);
+		return;
+	}
+	if (++index->stamp == 0)
+	{
+		memset(index->seen, 0, index->tree->count * sizeof(uint32_t));
+		index->stamp = 1;
+	}
+	PreparedQuery prepared;
+	prepare_query(&prepared, query);
+	CharStack *potential = reserve_potential(ws, radius);
+	uint32_t hashes[MAX_DELETES];
+	int count = word_deletes(query, radius, hashes);
+	for (int i = 0; i < count; i++)
+	{
+		uint32_t bucket = hashes[i] & index->mask;
+		for (uint32_t j = index->starts[bucket]; j < index->starts[bucket + 1]; j++)
+		{
+			uint32_t node = index->entries[j];
+			if (index->seen[node] == index->stamp)
+				continue;
+			index->seen[node] = index->stamp;
+			if (prefilter_bound(&prepared, &index->tree->nodes[node]) > radius)
+				continue;
+			int distance = prepared_distance_bounded(ws, &prepared, node_word(index->tree, node), radius);
+			if (distance <= radius)
+			{
+				push_char(&potential[distance], node_word(index->tree, node));
+			}
+		}
+	}
+	collect_results(potential, radius, max, results);
+}
+
+char *ltrim(char *s)
+{
+	while (isspace(*s))
+		s++;
+	return s;
+}
+
+char *rtrim(char *s)
+{
+	char *back = s + strlen(s);
+	while (isspace(*--back))
+		;
+	*(back + 1) = '\0';
+	return s;
+}
+
+char *trim(char *s)
+{
+	return rtrim(ltrim(s));
+}
+
+// Lays the nodes out breadth first. Every node's children end up next to each
+// other and the top levels, which every search goes through, are packed into
+// the first few KB. Words are moved into the same order
+void reorder_tree(WordTree *tree)
+{
+	if (tree->count == 0)
+	{
+		return;
+	}
+	uint32_t *order = malloc(tree->count * sizeof(uint32_t));
+	uint32_t *newIndex = malloc(tree->count * sizeof(uint32_t));
+	uint32_t tail = 0;
+	order[tail++] = ROOT_NODE;
+	for (uint32_t head = 0; head < tail; head++)
+	{
+		for (uint32_t child = tree->nodes[order[head]].firstChild; child != NO_NODE; child = tree->nodes[child].nextSibling)
+		{
+			order[tail++] = child;
+		}
+	}
+	for (uint32_t i = 0; i < tail; i++)
+	{
+		newIndex[order[i]] = i;
+	}
+	Node *nodes = malloc(tail * sizeof(Node));
+	char *words = malloc(tree->wordsLength);
+	size_t wordsLength = 0;
+	for (uint32_t i = 0; i < tail; i++)
+	{
+		Node node = tree->nodes[order[i]];
+		size_t len = strlen(tree->words + node.word) + 1;
+		memcpy(words + wordsLength, tree->words + node.word, len);
+		node.word = wordsLength;
+		wordsLength += len;
+		if (node.firstChild != NO_NODE)
+			node.firstChild = newIndex[node.firstChild];
+		if (node.nextSibling != NO_NODE)
+			node.nextSibling = newIndex[node.nextSibling];
+		nodes[i] = node;
+	}
+	free_tree(tree);
+	tree->nodes = nodes;
+	tree->count = tree->capacity = tail;
+	tree->words = words;
+	tree->wordsLength = tree->wordsCapacity = wordsLength;
+	free(order);
+	free(newIndex);
+}
+
+// Prints how much memory the tree takes per node, next to what it took when
+// every node was its own allocation with a table of MAX_CHAR child pointers
+void print_tree_memory(WordTree *tree)
+{
+	if (tree->count == 0)
+	{
+		return;
+	}
+	size_t tableNode = sizeof(struct { char *word; int maxDistance; void *children[MAX_CHAR]; });
+	printf("Tree: %u nodes, %zu bytes per node (%zu with child tables), %zu bytes of words\n",
+		   tree->count, sizeof(Node), tableNode, tree->wordsLength);
+	printf("Tree: %.1f MB %s (%.1f MB in %u allocations with child tables)\n",
+		   (tree->capacity * sizeof(Node) + tree->wordsCapacity) / 1e6, tree->mapping ? "mapped from file" : "in 2 allocations",
+		   (tree->count * tableNode + tree->wordsLength) / 1e6, 2 * tree->count);
+}
+
+// Copies all of src's nodes and words to the end of dst, returns the index
+// src's root ended up at or NO_NODE if src is empty
+uint32_t append_tree(WordTree *dst, const WordTree *src)
+{
+	if (src->count == 0)
+	{
+		return NO_NODE;
+	}
+	uint32_t base = dst->count;
+	size_t wordsBase = dst->wordsLength;
+	reserve_tree(dst, dst->count + src->count, dst->wordsLength + src->wordsLength);
+	for (uint32_t i = 0; i < src->count; i++)
+	{
+		Node node = src->nodes[i];
+		node.word += wordsBase;
+		if (node.firstChild != NO_NODE)
+			node.firstChild += base;
+		if (node.nextSibling != NO_NODE)
+			node.nextSibling += base;
+		dst->nodes[base + i] = node;
+	}
+	memcpy(dst->words + wordsBase, src->words, src->wordsLength);
+	dst->wordsLength += src->wordsLength;
+	publish_count(dst, dst->count + src->count);
+	return base;
+}
+
+int cpu_count(void)
+{
+#ifdef _WIN32
+	char *env = getenv("NUMBER_OF_PROCESSORS");
+	int count = env ? atoi(env) : 1;
+#else
+	int count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return count > 0 ? count : 1;
+}
+
+// A word only ever gets compared against nodes it shares a distance to the
+// root with, so the words can be split by their distance to the root and each
+// group built into its own subtree without looking at the others. Doing that
+// again for the large groups gives the threads enough independent pieces, and
+// the result is the same tree as inserting the words one by one.
+// Finished pieces go straight into the shared tree, so searches running during
+// the build see it fill in
+typedef struct BuildJob
+{
+	// Words of this subtree in file order, the first one is its root
+	char **words;
+	uint32_t count;
+	// Job whose root this one hangs under and at what distance, -1 for the top
+	int parent;
+	int distance;
+	// Where the job's root went in the shared tree, NO_NODE until it's there
+	uint32_t root;
+	// Buckets handed to the child jobs when this one was split
+	char **buckets;
+	// Set for jobs that only help another job's split
+	struct BuildPartition *partition;
+} BuildJob;
+
+// Distances from a split job's root to its other words. The big splits near
+// the top would otherwise run on one thread while the rest wait for their
+// buckets, so the words are handed out in chunks to helper jobs as well
+typedef struct BuildPartition
+{
+	PreparedQuery prepared;
+	char **words;
+	uint32_t count;
+	// Bucket of each word, -1 for a repeat of the root
+	int *indexes;
+	uint32_t chunkCount;
+	uint32_t nextChunk;
+	uint32_t chunksDone;
+	// The splitting job and each helper let go of it once they're done
+	int references;
+} BuildPartition;
+
+#define BUILD_CHUNK_SIZE 1024
+
+// Jobs larger than this get split, small enough that subtrees show up in the
+// shared tree often and a few large groups don't leave threads idle
+#define BUILD_SPLIT_SIZE 4096
+
+typedef struct ParallelBuild
+{
+	WordTree *tree;
+	BuildJob *jobs;
+	int jobCount;
+	int jobCapacity;
+	int nextJob;
+	// Jobs queued or running, the build is over when it hits 0
+	int pending;
+	int threads;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	size_t *completed;
+	bool *kill;
+} ParallelBuild;
+
+void build_progress(ParallelBuild *build, const char *word)
+{
+	__atomic_fetch_add(build->completed, strlen(word) + 1, __ATOMIC_RELAXED);
+}
+
+// Hangs the job's root (already in the shared tree) under its parent's. Called
+// with the lock held
+void link_build_job(ParallelBuild *build, int index, uint32_t root)
+{
+	BuildJob *job = &build->jobs[index];
+	job->root = root;
+	if (root != NO_NODE && job->parent >= 0 && build->jobs[job->parent].root != NO_NODE)
+	{
+		add_child(build->tree, build->jobs[job->parent].root, root, job->distance);
+	}
+}
+
+// Called with the lock held
+void queue_build_job(ParallelBuild *build, BuildJob job)
+{
+	if (build->jobCount == build->jobCapacity)
+	{
+		build->jobCapacity *= 2;
+		build->jobs = realloc(build->jobs, build->jobCapacity * sizeof(BuildJob));
+	}
+	build->jobs[build->jobCount++] = job;
+	build->pending++;
+}
+
+// Works through chunks of the partition until none are left
+void run_partition(ParallelBuild *build, BuildPartition *partition, DistanceWorkspace *ws)
+{
+	uint32_t chunk;
+	while ((chunk = __atomic_fetch_add(&partition->nextChunk, 1, __ATOMIC_RELAXED)) < partition->chunkCount)
+	{
+		// Word 0 is the root
+		uint32_t start = 1 + chunk * BUILD_CHUNK_SIZE;
+		uint32_t end = min(start + BUILD_CHUNK_SIZE, partition->count);
+		for (uint32_t i = start; i < end && !*build->kill; i++)
+		{
+			int distance = prepared_distance(ws, &partition->prepared, partition->words[i]);
+			// Same as insert, a repeat of the root word is dropped
+			partition->indexes[i] = distance == 0 ? -1 : distance % MAX_CHAR;
+			if (distance == 0)
+				build_progress(build, partition->words[i]);
+		}
+		if (__atomic_add_fetch(&partition->chunksDone, 1, __ATOMIC_ACQ_REL) == partition->chunkCount)
+		{
+			pthread_mutex_lock(&build->lock);
+			pthread_cond_broadcast(&build->wake);
+			pthread_mutex_unlock(&build->lock);
+		}
+	}
+}
+
+void release_partition(BuildPartition *partition)
+{
+	if (__atomic_sub_fetch(&partition->references, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		free(partition);
+	}
+}
+
+// Adds the job's root and queues one job per distance for the rest. Called
+// without the lock held
+void split_build_job(ParallelBuild *build, int index, BuildJob *job, DistanceWorkspace *ws)
+{
+	pthread_mutex_lock(&build->lock);
+	link_build_job(build, index, createNode(build->tree, job->words[0]));
+	pthread_mutex_unlock(&build->lock);
+	build_progress(build, job->words[0]);
+
+	BuildPartition *partition = malloc(sizeof(BuildPartition));
+	prepare_query(&partition->prepared, job->words[0]);
+	partition->words = job->words;
+	partition->count = job->count;
+	partition->indexes = malloc(job->count * sizeof(int));
+	partition->chunkCount = (job->count - 1 + BUILD_CHUNK_SIZE - 1) / BUILD_CHUNK_SIZE;
+	partition->nextChunk = 0;
+	partition->chunksDone = 0;
+	int helpers = min(partition->chunkCount - 1, build->threads - 1);
+	partition->references = 1 + helpers;
+	if (helpers > 0)
+	{
+		pthread_mutex_lock(&build->lock);
+		for (int i = 0; i < helpers; i++)
+		{
+			queue_build_job(build, (BuildJob){.parent = -1, .root = NO_NODE, .partition = partition});
+		}
+		pthread_cond_broadcast(&build->wake);
+		pthread_mutex_unlock(&build->lock);
+	}
+	run_partition(build, partition, ws);
+	// Only waits on chunks helpers are already working on
+	pthread_mutex_lock(&build->lock);
+	while (__atomic_load_n(&partition->chunksDone, __ATOMIC_ACQUIRE) < partition->chunkCount)
+		pthread_cond_wait(&build->wake, &build->lock);
+	pthread_mutex_unlock(&build->lock);
+	int *indexes = partition->indexes;
+	release_partition(partition);
+	if (*build->kill)
+	{
+		free(indexes);
+		return;
+	}
+
+	uint32_t sizes[MAX_CHAR] = {0};
+	for (uint32_t i = 1; i < job->count; i++)
+	{
+		if (indexes[i] >= 0)
+			sizes[indexes[i]]++;
+	}
+	uint32_t offsets[MAX_CHAR];
+	uint32_t total = 0;
+	for (int d = 0; d < MAX_CHAR; d++)
+	{
+		offsets[d] = total;
+		total += sizes[d];
+	}
+	char **buckets = malloc((total ? total : 1) * sizeof(char *));
+	for (uint32_t i = 1; i < job->count; i++)
+	{
+		if (indexes[i] >= 0)
+			buckets[offsets[indexes[i]]++] = job->words[i];
+	}
+	free(indexes);
+
+	pthread_mutex_lock(&build->lock);
+	build->jobs[index].buckets = buckets;
+	for (int d = 0; d < MAX_CHAR; d++)
+	{
+		if (sizes[d] == 0)
+			continue;
+		// offsets[d] is now the end of bucket d
+		queue_build_job(build, (BuildJob){.words = buckets + offsets[d] - sizes[d], .count = sizes[d], .parent = index, .distance = d, .root = NO_NODE});
+	}
+	pthread_cond_broadcast(&build->wake);
+	pthread_mutex_unlock(&build->lock);
+}
+
+void *build_worker(void *args)
+{
+	ParallelBuild *build = args;
+	DistanceWorkspace ws;
+	init_workspace(&ws);
+	while (true)
+	{
+		pthread_mutex_lock(&build->lock);
+		while (build->nextJob == build->jobCount && build->pending > 0)
+			pthread_cond_wait(&build->wake, &build->lock);
+		if (build->nextJob == build->jobCount)
+		{
+			pthread_mutex_unlock(&build->lock);
+			break;
+		}
+		int index = build->nextJob++;
+		BuildJob job = build->jobs[index];
+		pthread_mutex_unlock(&build->lock);
+
+		WordTree subtree;
+		init_tree(&subtree);
+		if (job.partition != NULL)
+		{
+			run_partition(build, job.partition, &ws);
+			release_partition(job.partition);
+		}
+		else if (job.count > BUILD_SPLIT_SIZE)
+		{
+			split_build_job(build, index, &job, &ws);
+		}
+		else
+		{
+			for (uint32_t i = 0; i < job.count && !*build->kill; i++)
+			{
+				insert(&subtree, job.words[i], &ws);
+				build_progress(build, job.words[i]);
+			}
+		}
+
+		pthread_mutex_lock(&build->lock);
+		if (subtree.count > 0)
+		{
+			link_build_job(build, index, append_tree(build->tree, &subtree));
+		}
+		build->pending--;
+		if (build->pending == 0)
+			pthread_cond_broadcast(&build->wake);
+		pthread_mutex_unlock(&build->lock);
+		free_tree(&subtree);
+	}
+	free_workspace(&ws);
+	return NULL;
+}
+
+// Builds a tree of words (in the order they'd be inserted) into an empty tree
+// on threads threads, including the calling one. tree can be searched while
+// this runs. Its subtrees land in the order they finish, reorder_tree once
+// nothing is reading it anymore
+void build_tree_parallel(WordTree *tree, char **words, uint32_t count, int threads, size_t *completed, bool *kill)
+{
+	if (count == 0)
+	{
+		return;
+	}
+	// Room for every word up front, the arrays can't move under a reader
+	size_t wordsLength = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		wordsLength += strlen(words[i]) + 1;
+	}
+	reserve_tree(tree, count, wordsLength);
+	ParallelBuild build = {0};
+	build.tree = tree;
+	build.jobCapacity = 256;
+	build.jobs = malloc(build.jobCapacity * sizeof(BuildJob));
+	build.jobs[0] = (BuildJob){.words = words, .count = count, .parent = -1, .root = NO_NODE};
+	build.jobCount = 1;
+	build.pending = 1;
+	build.threads = threads;
+	build.completed = completed;
+	build.kill = kill;
+	pthread_mutex_init(&build.lock, NULL);
+	pthread_cond_init(&build.wake, NULL);
+	pthread_t *workers = malloc(threads * sizeof(pthread_t));
+	for (int i = 1; i < threads; i++)
+	{
+		pthread_create(&workers[i], NULL, build_worker, &build);
+	}
+	build_worker(&build);
+	for (int i = 1; i < threads; i++)
+	{
+		pthread_join(workers[i], NULL);
+	}
+	free(workers);
+	pthread_mutex_destroy(&build.lock);
+	pthread_cond_destroy(&build.wake);
+
+	for (int i = 0; i < build.jobCount; i++)
+	{
+		free(build.jobs[i].buckets);
+	}
+	free(build.jobs);
+}
+
+// Splits the words file in place into trimmed, non-empty words in file order
+char **split_words(char *string, uint32_t *count)
+{
+	uint32_t capacity = 1024;
+	char **words = malloc(capacity * sizeof(char *));
+	*count = 0;
+	for (char *word = strtok(string, "\n"); word != NULL; word = strtok(NULL, "\n"))
+	{
+		word = trim(word);
+		if (*word == '\0')
+			continue;
+		if (*count == capacity)
+		{
+			capacity *= 2;
+			words = realloc(words, capacity * sizeof(char *));
+		}
+		words[(*count)++] = word;
+	}
+	return words;
+}
+
+// Builds the tree from words.txt into tree, which has to be empty. Returns
+// false if there's no words.txt
+bool build_word_file(WordTree *tree, size_t *total, size_t *completed, bool *kill)
+{
+	FILE *fp = fopen("words.txt", "r");
+	if (fp == NULL)
+		return false;
+	fseek(fp, 0, SEEK_END);
+	long fsize = ftell(fp);
+	fseek(fp, 0, SEEK_SET); /* same as rewind(f); */
+	// printf("Filesize %d", fsize);
+	char *string = malloc(fsize + 1);
+	fread(string, fsize, 1, fp);
+	fclose(fp);
+
+	*total = fsize;
+
+	string[fsize] = 0;
+	uint32_t count;
+	char **words = split_words(string, &count);
+	*completed = 0;
+	build_tree_parallel(tree, words, count, cpu_count(), completed, kill);
+	free(words);
+	free(string);
+	return true;
+}
+
+void *create_tree(void *args)
+{
+	struct IndexingArguments *arguments = args;
+
+	WordTree *tree = arguments->tree;
+	if (!build_word_file(tree, arguments->total, arguments->completed, arguments->kill))
+		exit(EXIT_FAILURE);
+	print_tree_memory(tree);
+	*arguments->done = true;
+	pthread_exit(0);
+}
+
+// Writes the tree as a TreeFileHeader followed by the node array and word pool
+// to path. The tree may be a mapping of path itself, so it's written next to
+// it and only renamed over it once it's all written. Returns false if it isn't
+bool write_tree(WordTree *tree, const char *path)
+{
+	char temporary[512];
+	snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+	FILE *file = fopen(temporary, "wb");
+	if (file == NULL)
+	{
+		printf("Couldn't write %s\n", temporary);
+		return false;
+	}
+	TreeFileHeader header = {0};
+	memcpy(header.magic, TREE_FILE_MAGIC, sizeof(TREE_FILE_MAGIC));
+	header.version = TREE_FILE_VERSION;
+	header.nodeSize = sizeof(Node);
+	header.count = tree->count;
+	header.nodesOffset = sizeof(header);
+	header.wordsOffset = header.nodesOffset + (uint64_t)tree->count * sizeof(Node);
+	header.wordsLength = tree->wordsLength;
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+				   fwrite(tree->nodes, sizeof(Node), tree->count, file) == tree->count &&
+				   fwrite(tree->words, 1, tree->wordsLength, file) == tree->wordsLength;
+	written = fclose(file) == 0 && written;
+#ifdef _WIN32
+	// rename won't replace a file there
+	written = written && (remove(path) == 0 || errno == ENOENT);
+#endif
+	if (!written || rename(temporary, path) != 0)
+	{
+		printf("Couldn't save the tree to %s\n", path);
+		remove(temporary);
+		return false;
+	}
+	return true;
+}
+
+// Checks nodes read from a file can be searched without reading outside them:
+// every link is a node, every word starts in the pool (which ends in a '\0'),
+// every node is some node's child only once, so there are no cycles, and every
+// child list goes up by distance below MAX_CHAR, which search sizes its
+// per-distance arrays by
+bool valid_tree_nodes(const Node *nodes, uint32_t count, size_t wordsLength)
+{
+	uint8_t *reached = calloc((count + 7) / 8, 1);
+	bool valid = true;
+	for (uint32_t i = 0; i < count && valid; i++)
+	{
+		const Node *node = &nodes[i];
+		valid = node->word < wordsLength &&
+				(node->firstChild == NO_NODE || node->firstChild < count) &&
+				(node->nextSibling == NO_NODE || node->nextSibling < count);
+		uint32_t links[2] = {node->firstChild, node->nextSibling};
+		for (int k = 0; k < 2 && valid; k++)
+		{
+			uint32_t child = links[k];
+			if (child == NO_NODE)
+				continue;
+			valid = child != ROOT_NODE && !(reached[child / 8] & 1 << child % 8);
+			reached[child / 8] |= 1 << child % 8;
+		}
+	}
+	free(reached);
+	// Without cycles every list ends, and each node is only walked once
+	for (uint32_t i = 0; i < count && valid; i++)
+	{
+		int previous = 0;
+		for (uint32_t child = nodes[i].firstChild; child != NO_NODE && valid; child = nodes[child].nextSibling)
+		{
+			valid = nodes[child].distance > previous && nodes[child].distance < MAX_CHAR;
+			previous = nodes[child].distance;
+		}
+	}
+	return valid;
+}
+
+// Points tree at a mapping of a file written by write_tree without reading
+// the nodes. Returns 1 on success, 0 when the file isn't in this format (the
+// old text format, or missing) and -1 when it is but can't be used
+int map_tree(WordTree *tree, const char *path)
+{
+	size_t size = 0;
+	char *data = map_file(path, &size);
+	if (data == NULL)
+	{
+		return 0;
+	}
+	const TreeFileHeader *header = (const TreeFileHeader *)data;
+	if (size < sizeof(TreeFileHeader) || memcmp(header->magic, TREE_FILE_MAGIC, sizeof(TREE_FILE_MAGIC)) != 0)
+	{
+		unmap_file(data, size);
+		return 0;
+	}
+	if (header->version != TREE_FILE_VERSION || header->nodeSize != sizeof(Node))
+	{
+		printf("%s was written by a different version (%u, this one writes %u)\n", path, header->version, TREE_FILE_VERSION);
+		unmap_file(data, size);
+		return -1;
+	}
+	bool valid = header->count > 0 &&
+				 header->nodesOffset >= sizeof(TreeFileHeader) && header->nodesOffset % sizeof(uint32_t) == 0 &&
+				 header->nodesOffset <= size && (uint64_t)header->count * sizeof(Node) <= size - header->nodesOffset &&
+				 header->wordsLength > 0 && header->wordsOffset <= size && header->wordsLength <= size - header->wordsOffset &&
+				 data[header->wordsOffset + header->wordsLength - 1] == '\0';
+	if (!valid || !valid_tree_nodes((const Node *)(data + header->nodesOffset), header->count, header->wordsLength))
+	{
+		printf("%s is damaged\n", path);
+		unmap_file(data, size);
+		return -1;
+	}
+	init_tree(tree);
+	tree->nodes = (Node *)(data + header->nodesOffset);
+	tree->count = tree->capacity = header->count;
+	tree->words = data + header->wordsOffset;
+	tree->wordsLength = tree->wordsCapacity = header->wordsLength;
+	tree->mapping = data;
+	tree->mappingSize = size;
+	return 1;
+}
+
+// Reads one node and its children from the old text format into the tree,
+// returns its index or NO_NODE at the end of a child list
+uint32_t deSerialize(WordTree *tree, FILE *fp, size_t *completed, bool *kill)
+{
+	// Read next item from file. If there are no more items or next
+	// item is marker, then return NO_NODE to indicate same
+	char val[128];
+	if (!fscanf(fp, "%s :::", (char *)&val) || strcmp(val, MARKER) == 0)
+		return NO_NODE;
+
+	// Else create node with this item and recur for children
+	uint32_t node = createNode(tree, val);
+	*completed = ftell(fp);
+	int idx;
+	while (fscanf(fp, "%d --", &idx) && !*kill)
+	{
+		uint32_t child = deSerialize(tree, fp, completed, kill);
+		if (child != NO_NODE)
+		{
+			add_child(tree, node, child, idx);
+		}
+	}
+	if (*kill)
+	{
+		return node;
+	}
+	fscanf(fp, "%s :::", (char *)&val);
+	if (strcmp(val, MARKER) != 0)
+	{
+		exit(1);
+	}
+	return node;
+}
+
+void print_tree(WordTree *tree, uint32_t node)
+{
+	printf("%s -- \n", node_word(tree, node));
+	for (uint32_t child = tree->nodes[node].firstChild; child != NO_NODE; child = tree->nodes[child].nextSibling)
+	{
+		printf("%d. ", tree->nodes[child].distance);
+		print_tree(tree, child);
+	}
+}
+
+// Loads into a tree of its own and only hands the finished tree over, tree
+// may be searched in the meantime
+void read_tree(WordTree *tree, size_t *total, size_t *completed, bool *kill)
+{
+	WordTree loaded;
+	init_tree(&loaded);
+	int mapped = map_tree(&loaded, "bktree.bin");
+	if (mapped == 1)
+	{
+		*total = *completed = loaded.mappingSize;
+		publish_tree(tree, &loaded);
+		return;
+	}
+	if (mapped == -1)
+	{
+		// Binary, so the text format below can't read it either
+		printf("Building the tree from words.txt instead\n");
+		if (build_word_file(&loaded, total, completed, kill))
+		{
+			reorder_tree(&loaded);
+			publish_tree(tree, &loaded);
+		}
+		return;
+	}
+	// Trees saved before the binary format
+	FILE *file = fopen("bktree.bin", "r");
+	if (file != NULL)
+	{
+		fseek(file, 0, SEEK_END);
+		long fsize = ftell(file);
+		fseek(file, 0, SEEK_SET); /* same as rewind(f); */
+		*total = fsize;
+		deSerialize(&loaded, file, completed, kill);
+		fclose(file);
+		reorder_tree(&loaded);
+		publish_tree(tree, &loaded);
+		// print_tree(tree, ROOT_NODE);
+	}
+}
+
+void *load_tree(void *args)
+{
+	LoadingArguments *arguments = args;
+	read_tree(arguments->tree, arguments->total, arguments->completed, arguments->kill);
+	print_tree_memory(arguments->tree);
+	*arguments->done = true;
+	pthread_exit(0);
+}
+
+// Side of the grayscale copy images are hashed from
+#define DCT_SIZE 32
+// The hash is taken from the 8 lowest frequencies down by the 8 after the
+// first across, the transform is only worked out that far
+#define DCT_HASH_ROWS 8
+#define DCT_HASH_COLS 9
+
+// Cosines of the transform, dctBasis[i][k] being frequency i at pixel k. The
+// same values the transform used to call cos for, worked out once.
+// dctBasisT is the same transposed
+double dctBasis[DCT_SIZE][DCT_SIZE];
+double dctBasisT[DCT_SIZE][DCT_SIZE];
+
+// out = a * b for a rows x DCT_SIZE and b DCT_SIZE x cols
+void dct_multiply(const double a[][DCT_SIZE], const double b[][DCT_SIZE], int rows, int cols, double out[][DCT_SIZE])
+{
+	for (int i = 0; i < rows; i++)
+	{
+		for (int j = 0; j < cols; j++)
+		{
+			out[i][j] = 0;
+		}
+		for (int k = 0; k < DCT_SIZE; k++)
+		{
+			for (int j = 0; j < cols; j++)
+			{
+				out[i][j] += a[i][k] * b[k][j];
+			}
+		}
+	}
+}
+
+// Fills in the part of the DCT of a DCT_SIZE square of pixels the hash is
+// taken from, DCT_HASH_ROWS rows of the 8 coefficients after the first
+typedef void (*DctKernel)(const unsigned char *pixels, float dct[][DCT_SIZE]);
+
+// The coefficients have to come out exactly as the transform always worked
+// them out, or hashes near the average flip: every one is a float sum of one
+// term per pixel, row by row, each term rounded to float before it's added.
+// Only the cosines come from the tables now. The 8 coefficients of a row are
+// summed side by side, each in its own order
+void dct_hash_block_scalar(const unsigned char *pixels, float dct[][DCT_SIZE])
+{
+	for (int i = 0; i < DCT_HASH_ROWS; i++)
+	{
+		float sums[8] = {0};
+		for (int k = 0; k < DCT_SIZE; k++)
+		{
+			for (int l = 0; l < DCT_SIZE; l++)
+			{
+				double value = (int)pixels[k * DCT_SIZE + l] * dctBasis[i][k];
+				for (int j = 0; j < 8; j++)
+				{
+					float term = value * dctBasisT[l][j + 1];
+					sums[j] += term;
+				}
+			}
+		}
+		// ci and cj scale the first frequency differently from the rest
+		float ci = i == 0 ? 1. / sqrt(DCT_SIZE) : sqrt(2. / DCT_SIZE);
+		float cj = sqrt(2. / DCT_SIZE);
+		for (int j = 0; j < 8; j++)
+		{
+			dct[i][j + 1] = ci * cj * sums[j];
+		}
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+// dct_hash_block_scalar with the 8 sums in one vector. The products are
+// still doubles rounded to floats and nothing is fused, so every step rounds
+// the same as the scalar one
+__attribute__((target("avx"))) void dct_hash_block_avx(const unsigned char *pixels, float dct[][DCT_SIZE])
+{
+	for (int i = 0; i < DCT_HASH_ROWS; i++)
+	{
+		__m256 sums = _mm256_setzero_ps();
+		for (int k = 0; k < DCT_SIZE; k++)
+		{
+			for (int l = 0; l < DCT_SIZE; l++)
+			{
+				__m256d value = _mm256_set1_pd((int)pixels[k * DCT_SIZE + l] * dctBasis[i][k]);
+				__m128 low = _mm256_cvtpd_ps(_mm256_mul_pd(value, _mm256_loadu_pd(&dctBasisT[l][1])));
+				__m128 high = _mm256_cvtpd_ps(_mm256_mul_pd(value, _mm256_loadu_pd(&dctBasisT[l][5])));
+				sums = _mm256_add_ps(sums, _mm256_insertf128_ps(_mm256_castps128_ps256(low), high, 1));
+			}
+		}
+		float row[8];
+		_mm256_storeu_ps(row, sums);
+		float ci = i == 0 ? 1. / sqrt(DCT_SIZE) : sqrt(2. / DCT_SIZE);
+		float cj = sqrt(2. / DCT_SIZE);
+		for (int j = 0; j < 8; j++)
+		{
+			dct[i][j + 1] = ci * cj * row[j];
+		}
+	}
+}
+#endif
+
+DctKernel dctKernel = dct_hash_block_scalar;
+pthread_once_t dctOnce = PTHREAD_ONCE_INIT;
+
+// Fills in the cosines and picks the kernel, once per process
+void init_dct(void)
+{
+	for (int i = 0; i < DCT_SIZE; i++)
+	{
+		for (int k = 0; k < DCT_SIZE; k++)
+		{
+			dctBasis[i][k] = cos((PI / DCT_SIZE) * (k + .5) * i);
+			dctBasisT[k][i] = dctBasis[i][k];
+		}
+	}
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx"))
+		dctKernel = dct_hash_block_avx;
+#endif
+}
+
+// The top left rows x cols of the 2D DCT of a DCT_SIZE square of pixels,
+// into dct with a row of DCT_SIZE per frequency. It's separable, so it's the
+// pixels times the transposed cosines for every row, and the cosines times
+// that for the columns. The sums are doubles, which isn't always what the
+// hash's float sums come to, so it's only for the debug picture
+void dct_block(const unsigned char *pixels, int rows, int cols, float dct[][DCT_SIZE])
+{
+	pthread_once(&dctOnce, init_dct);
+	double values[DCT_SIZE][DCT_SIZE];
+	double rowDct[DCT_SIZE][DCT_SIZE];
+	double colDct[DCT_SIZE][DCT_SIZE];
+	for (int i = 0; i < DCT_SIZE * DCT_SIZE; i++)
+	{
+		values[i / DCT_SIZE][i % DCT_SIZE] = pixels[i];
+	}
+	dct_multiply((const double(*)[DCT_SIZE])values, (const double(*)[DCT_SIZE])dctBasisT, DCT_SIZE, cols, rowDct);
+	dct_multiply((const double(*)[DCT_SIZE])dctBasis, (const double(*)[DCT_SIZE])rowDct, rows, cols, colDct);
+	for (int i = 0; i < rows; i++)
+	{
+		// ci and cj scale the first frequency differently from the rest
+		float ci = i == 0 ? 1. / sqrt(DCT_SIZE) : sqrt(2. / DCT_SIZE);
+		for (int j = 0; j < cols; j++)
+		{
+			float cj = j == 0 ? 1. / sqrt(DCT_SIZE) : sqrt(2. / DCT_SIZE);
+			dct[i][j] = ci * cj * (float)colDct[i][j];
+		}
+	}
+}
+
+// The DCT_SIZE square grayscale copy of image the hash is taken from
+Image dct_input(Image image)
+{
+	Image copy = ImageCopy(image);
+	ImageResize(&copy, DCT_SIZE, DCT_SIZE);
+	ImageColorGrayscale(&copy);
+	return copy;
+}
+
+// Sets the hash bits from the 8x8 block after the first column of dct and
+// returns it, with their average in average
+unsigned long long int dct_hash_bits(float dct[][DCT_SIZE], float *average)
+{
+	int i, j;
+	float reducedDct[8][8];
+	float lowFreqTotal = 0.f;
+	// Reduce dct to 8x8 by taking top left to get lowest frequencies
+	for (i = 0; i < 8; i++)
+	{
+		for (j = 1; j < 9; j++)
+		{
+			reducedDct[i][j - 1] = dct[i][j];
+			lowFreqTotal += dct[i][j];
+		}
+	}
+
+	float avg = lowFreqTotal / 64;
+	unsigned long long int result = 0;
+	for (i = 0; i < 8; i++)
+	{
+		for (j = 0; j < 8; j++)
+		{
+			if (reducedDct[i][j] > avg)
+				result |= 1;
+			result = result << 1;
+		}
+	}
+	*average = avg;
+	return result;
+}
+
+// Hash of the pixels of a dct_input image. dct gets the block it came from
+unsigned long long int dct_hash(const unsigned char *pixels, float dct[][DCT_SIZE], float *average)
+{
+	pthread_once(&dctOnce, init_dct);
+	dctKernel(pixels, dct);
+	return dct_hash_bits(dct, average);
+}
+
+// The hash as the transform worked it out before it was separable, cosines
+// and all, kept to check dct_hash against
+unsigned long long int original_dct_hash(const unsigned char *pixels)
+{
+	int n = DCT_SIZE, m = DCT_SIZE;
+	float dct[DCT_SIZE][DCT_SIZE];
+	for (int i = 0; i < DCT_HASH_ROWS; i++)
+	{
+		for (int j = 0; j < DCT_HASH_COLS; j++)
+		{
+			float ci = i == 0 ? 1. / sqrt(m) : sqrt(2. / m);
+			float cj = j == 0 ? 1. / sqrt(n) : sqrt(2. / n);
+			float sum = 0;
+			for (int k = 0; k < m; k++)
+			{
+				for (int l = 0; l < n; l++)
+				{
+					float dct1 = (int)pixels[(k * 32) + l] *
+								 cos((PI / m) * (k + .5) * i) *
+								 cos((PI / n) * (l + .5) * j);
+					sum += dct1;
+				}
+			}
+			dct[i][j] = ci * cj * sum;
+		}
+	}
+	float average;
+	return dct_hash_bits(dct, &average);
+}
+
+// Saves the whole DCT of pixels as a black and white picture, black where
+// it's above the hash's average, to DctDebugDirectory under path's file name
+void write_dct_debug(const unsigned char *pixels, float avg, const char *path)
+{
+	float dct[DCT_SIZE][DCT_SIZE];
+	dct_block(pixels, DCT_SIZE, DCT_SIZE, dct);
+	unsigned char dctImageMatrix[DCT_SIZE][DCT_SIZE];
+	for (int i = 0; i < DCT_SIZE; i++)
+	{
+		for (int j = 0; j < DCT_SIZE; j++)
+		{
+			dctImageMatrix[i][j] = dct[i][j] > avg ? 0 : 255;
+		}
+	}
+	Image dctImage = {
+		.data = dctImageMatrix,
+		.width = DCT_SIZE,
+		.height = DCT_SIZE,
+		.format = PIXELFORMAT_UNCOMPRESSED_GRAYSCALE,
+		.mipmaps = 1};
+	Image allocatedDct = ImageCopy(dctImage);
+	ImageResize(&allocatedDct, 255, 255);
+	char file[4096];
+	snprintf(file, sizeof(file), "%s/%s.dct.png", DctDebugDirectory, GetFileName(path));
+	ExportImage(allocatedDct, file);
+	UnloadImage(allocatedDct);
+}
+
+// Perceptual hash of image. path is only used to name the debug picture
+unsigned long long int dctTransform(Image image, const char *path)
+{
+	Image copy = dct_input(image);
+	float dct[DCT_SIZE][DCT_SIZE];
+	float avg;
+	unsigned long long int result = dct_hash(copy.data, dct, &avg);
+	if (DctDebugDirectory != NULL)
+	{
+		write_dct_debug(copy.data, avg, path);
+	}
+	UnloadImage(copy);
+	return result;
+}
+
+// JPEGs are hashed from a grayscale decode at 1/2, 1/4 or 1/8 of their size,
+// the smallest that's still at least DCT_SIZE across. Only the luma is kept,
+// and each 8x8 block is only worked out as far as the low frequencies that
+// make up its shrunk block: at 1/8 a block is just its DC coefficient, so
+// progressive files only need their DC scans. Anything else goes to LoadImage
+
+// Natural order position of each coefficient in zigzag order
+const unsigned char jpegZigzag[64] = {
+	0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
+
+// Codes up to this long are looked up in one go
+#define JPEG_FAST_BITS 9
+
+typedef struct JpegHuffman
+{
+	// Length << 8 | symbol by the next JPEG_FAST_BITS bits, 0 for longer codes
+	uint16_t fast[1 << JPEG_FAST_BITS];
+	unsigned char values[256];
+	// Last code of each length, -1 for none, and how far the symbols of that
+	// length are from their codes
+	int maxCode[17];
+	int offset[17];
+	bool defined;
+} JpegHuffman;
+
+typedef struct JpegComponent
+{
+	int id;
+	int h, v;
+	int quant;
+	int dcTable, acTable;
+	int dcPrediction;
+} JpegComponent;
+
+typedef struct JpegDecoder
+{
+	const unsigned char *data;
+	size_t size;
+	size_t pos;
+	uint32_t bitBuffer;
+	int bitCount;
+	// Set once the entropy coded data runs into a marker, only zeros after that
+	bool marker;
+	// Bytes of those zeros handed out, past a few the scan has run out of data
+	int padding;
+	// In natural order
+	uint16_t quant[4][64];
+	JpegHuffman huffman[2][4];
+	JpegComponent components[3];
+	int componentCount;
+	int width, height;
+	int hMax, vMax;
+	bool progressive;
+	int restartInterval;
+	// Side of the block each 8x8 block shrinks to
+	int blockSize;
+	// The luma's low frequencies, blockSize squared per block and still
+	// quantized, with a row of blocksAcross blocks per 8 pixel rows
+	int *coefficients;
+	int blocksAcross;
+	int blocksDown;
+	bool lumaDecoded;
+} JpegDecoder;
+
+bool build_jpeg_huffman(JpegHuffman *table, const unsigned char *counts, const unsigned char *values)
+{
+	memset(table->fast, 0, sizeof(table->fast));
+	int code = 0;
+	int k = 0;
+	for (int len = 1; len <= 16; len++)
+	{
+		// More codes of this length than there are left would run off fast
+		if (code + counts[len - 1] > 1 << len)
+		{
+			return false;
+		}
+		table->offset[len] = k - code;
+		for (int i = 0; i < counts[len - 1]; i++, k++, code++)
+		{
+			table->values[k] = values[k];
+			if (len <= JPEG_FAST_BITS)
+			{
+				int shift = JPEG_FAST_BITS - len;
+				for (int j = 0; j < 1 << shift; j++)
+					table->fast[(code << shift) | j] = (uint16_t)(len << 8 | values[k]);
+			}
+		}
+		table->maxCode[len] = counts[len - 1] ? code - 1 : -1;
+		code <<= 1;
+	}
+	table->defined = true;
+	return true;
+}
+
+void jpeg_fill(JpegDecoder *d)
+{
+	while (d->bitCount <= 24)
+	{
+		int byte = 0;
+		if (!d->marker && d->pos < d->size)
+		{
+			byte = d->data[d->pos];
+			if (byte != 0xFF)
+				d->pos++;
+			else if (d->pos + 1 < d->size && d->data[d->pos + 1] == 0)
+				d->pos += 2;
+			else
+			{
+				d->marker = true;
+				byte = 0;
+			}
+		}
+		if (d->marker || d->pos >= d->size)
+			d->padding++;
+		d->bitBuffer |= (uint32_t)byte << (24 - d->bitCount);
+		d->bitCount += 8;
+	}
+}
+
+// The next n (1 to 16) bits
+int jpeg_bits(JpegDecoder *d, int n)
+{
+	jpeg_fill(d);
+	int value = d->bitBuffer >> (32 - n);
+	d->bitBuffer <<= n;
+	d->bitCount -= n;
+	return value;
+}
+
+// Turns the n bit value after a Huffman symbol into the signed number it stands for
+int jpeg_extend(int value, int n)
+{
+	return value < 1 << (n - 1) ? value - (1 << n) + 1 : value;
+}
+
+// Next Huffman coded symbol, -1 for a code that isn't in the table
+int jpeg_symbol(JpegDecoder *d, const JpegHuffman *table)
+{
+	jpeg_fill(d);
+	int entry = table->fast[d->bitBuffer >> (32 - JPEG_FAST_BITS)];
+	if (entry)
+	{
+		d->bitBuffer <<= entry >> 8;
+		d->bitCount -= entry >> 8;
+		return entry & 0xFF;
+	}
+	for (int len = JPEG_FAST_BITS + 1; len <= 16; len++)
+	{
+		int code = d->bitBuffer >> (32 - len);
+		if (code <= table->maxCode[len])
+		{
+			d->bitBuffer <<= len;
+			d->bitCount -= len;
+			return table->values[code + table->offset[len]];
+		}
+	}
+	return -1;
+}
+
+// Picks the entropy coded data up again after the next restart marker
+void jpeg_restart(JpegDecoder *d)
+{
+	d->bitBuffer = 0;
+	d->bitCount = 0;
+	d->marker = false;
+	d->padding = 0;
+	while (d->pos + 1 < d->size && !(d->data[d->pos] == 0xFF && d->data[d->pos + 1] >= 0xD0 && d->data[d->pos + 1] <= 0xD7))
+		d->pos++;
+	d->pos = d->pos + 2 < d->size ? d->pos + 2 : d->size;
+	for (int i = 0; i < d->componentCount; i++)
+		d->components[i].dcPrediction = 0;
+}
+
+// Decodes one block of c. out gets its low frequencies if it's a luma block,
+// NULL throws the block away. Sequential files have the whole block in one
+// scan, progressive ones only get here for DC scans: the first, ah == 0, has
+// the top bits of the DC and the refinements add one bit each
+bool jpeg_block(JpegDecoder *d, JpegComponent *c, int *out, int ah, int al)
+{
+	// The buffer holds 4 bytes ahead, more zeros than that were read as data
+	if (d->padding > 4)
+	{
+		return false;
+	}
+	if (d->progressive && ah != 0)
+	{
+		if (jpeg_bits(d, 1) && out != NULL)
+			out[0] |= 1 << al;
+		return true;
+	}
+	int t = jpeg_symbol(d, &d->huffman[0][c->dcTable]);
+	if (t < 0 || t > 16)
+	{
+		return false;
+	}
+	c->dcPrediction += t ? jpeg_extend(jpeg_bits(d, t), t) : 0;
+	// Far past anything 8 bit samples give, and it mustn't overflow
+	if (abs(c->dcPrediction) > 32767)
+	{
+		return false;
+	}
+	int n = d->blockSize;
+	if (out != NULL)
+	{
+		memset(out, 0, n * n * sizeof(int));
+		out[0] = d->progressive ? c->dcPrediction * (1 << al) : c->dcPrediction;
+	}
+	if (d->progressive)
+	{
+		return true;
+	}
+	for (int k = 1; k < 64;)
+	{
+		int rs = jpeg_symbol(d, &d->huffman[1][c->acTable]);
+		if (rs < 0)
+		{
+			return false;
+		}
+		int r = rs >> 4;
+		int size = rs & 15;
+		if (size == 0)
+		{
+			// End of block, or a run of 16 zeros
+			if (r != 15)
+				break;
+			k += 16;
+			continue;
+		}
+		k += r;
+		if (k > 63)
+		{
+			return false;
+		}
+		int value = jpeg_extend(jpeg_bits(d, size), size);
+		int natural = jpegZigzag[k];
+		if (out != NULL && natural / 8 < n && natural % 8 < n)
+			out[natural / 8 * n + natural % 8] = value;
+		k++;
+	}
+	return true;
+}
+
+// Decodes the scan starting at d->pos over the count components in scan
+bool jpeg_scan(JpegDecoder *d, JpegComponent **scan, int count, int ah, int al)
+{
+	JpegComponent *luma = &d->components[0];
+	int n = d->blockSize;
+	int units = 0;
+	if (count == 1)
+	{
+		// A single component goes block by block across only its own area
+		JpegComponent *c = scan[0];
+		int across = ((d->width * c->h + d->hMax - 1) / d->hMax + 7) / 8;
+		int down = ((d->height * c->v + d->vMax - 1) / d->vMax + 7) / 8;
+		for (int by = 0; by < down; by++)
+		{
+			for (int bx = 0; bx < across; bx++, units++)
+			{
+				if (d->restartInterval && units > 0 && units % d->restartInterval == 0)
+					jpeg_restart(d);
+				int *out = c == luma ? d->coefficients + ((size_t)by * d->blocksAcross + bx) * n * n : NULL;
+				if (!jpeg_block(d, c, out, ah, al))
+					return false;
+			}
+		}
+		return true;
+	}
+	// Otherwise in MCUs, each with h x v blocks of every component
+	int mcusAcross = (d->width + 8 * d->hMax - 1) / (8 * d->hMax);
+	int mcusDown = (d->height + 8 * d->vMax - 1) / (8 * d->vMax);
+	for (int my = 0; my < mcusDown; my++)
+	{
+		for (int mx = 0; mx < mcusAcross; mx++, units++)
+		{
+			if (d->restartInterval && units > 0 && units % d->restartInterval == 0)
+				jpeg_restart(d);
+			for (int i = 0; i < count; i++)
+			{
+				JpegComponent *c = scan[i];
+				for (int y = 0; y < c->v; y++)
+				{
+					for (int x = 0; x < c->h; x++)
+					{
+						size_t block = (size_t)(my * c->v + y) * d->blocksAcross + mx * c->h + x;
+						if (!jpeg_block(d, c, c == luma ? d->coefficients + block * n * n : NULL, ah, al))
+							return false;
+					}
+				}
+			}
+		}
+	}
+	return true;
+}
+
+// Moves d->pos to the next marker that isn't part of entropy coded data
+void jpeg_skip_to_marker(JpegDecoder *d)
+{
+	while (d->pos + 1 < d->size)
+	{
+		unsigned char next = d->data[d->pos + 1];
+		if (d->data[d->pos] == 0xFF && next != 0 && next != 0xFF && !(next >= 0xD0 && next <= 0xD7))
+			return;
+		d->pos++;
+	}
+	d->pos = d->size;
+}
+
+bool jpeg_frame(JpegDecoder *d, const unsigned char *segment, size_t length)
+{
+	if (d->componentCount != 0 || length < 6 || segment[0] != 8)
+	{
+		return false;
+	}
+	d->height = segment[1] << 8 | segment[2];
+	d->width = segment[3] << 8 | segment[4];
+	d->componentCount = segment[5];
+	if (d->width == 0 || d->height == 0 || (d->componentCount != 1 && d->componentCount != 3) || length < 6 + 3 * (size_t)d->componentCount)
+	{
+		return false;
+	}
+	d->hMax = 1;
+	d->vMax = 1;
+	for (int i = 0; i < d->componentCount; i++)
+	{
+		JpegComponent *c = &d->components[i];
+		c->id = segment[6 + 3 * i];
+		c->h = segment[7 + 3 * i] >> 4;
+		c->v = segment[7 + 3 * i] & 15;
+		c->quant = segment[8 + 3 * i];
+		if (c->h < 1 || c->h > 4 || c->v < 1 || c->v > 4 || c->quant > 3)
+			return false;
+		d->hMax = max(d->hMax, c->h);
+		d->vMax = max(d->vMax, c->v);
+	}
+	// The luma has to be the full size one
+	if (d->components[0].h != d->hMax || d->components[0].v != d->vMax)
+	{
+		return false;
+	}
+	int scale = 8;
+	while (scale > 1 && ((d->width + scale - 1) / scale < DCT_SIZE || (d->height + scale - 1) / scale < DCT_SIZE))
+		scale /= 2;
+	d->blockSize = 8 / scale;
+	// Progressive files spread the rest of the block over scans that need
+	// every earlier one to decode
+	if (d->progressive && d->blockSize > 1)
+	{
+		return false;
+	}
+	d->blocksAcross = (d->width + 8 * d->hMax - 1) / (8 * d->hMax) * d->components[0].h;
+	d->blocksDown = (d->height + 8 * d->vMax - 1) / (8 * d->vMax) * d->components[0].v;
+	// Every block takes at least a bit of the file
+	if ((size_t)d->blocksAcross * d->blocksDown > 8 * d->size)
+	{
+		return false;
+	}
+	d->coefficients = calloc((size_t)d->blocksAcross * d->blocksDown * d->blockSize * d->blockSize, sizeof(int));
+	return d->coefficients != NULL;
+}
+
+bool jpeg_start_scan(JpegDecoder *d, const unsigned char *segment, size_t length)
+{
+	int count = length > 0 ? segment[0] : 0;
+	if (d->componentCount == 0 || count < 1 || count > d->componentCount || length < 4 + 2 * (size_t)count)
+	{
+		return false;
+	}
+	JpegComponent *scan[3];
+	bool hasLuma = false;
+	for (int i = 0; i < count; i++)
+	{
+		scan[i] = NULL;
+		for (int j = 0; j < d->componentCount; j++)
+		{
+			if (d->components[j].id == segment[1 + 2 * i])
+				scan[i] = &d->components[j];
+		}
+		if (scan[i] == NULL)
+			return false;
+		scan[i]->dcTable = segment[2 + 2 * i] >> 4;
+		scan[i]->acTable = segment[2 + 2 * i] & 15;
+		if (scan[i]->dcTable > 3 || scan[i]->acTable > 3)
+			return false;
+		hasLuma = hasLuma || scan[i] == &d->components[0];
+	}
+	int ss = segment[1 + 2 * count];
+	int ah = segment[3 + 2 * count] >> 4;
+	int al = segment[3 + 2 * count] & 15;
+	// Scans without the luma and progressive AC scans aren't needed at all
+	if (!hasLuma || (d->progressive && ss != 0))
+	{
+		return true;
+	}
+	for (int i = 0; i < count; i++)
+	{
+		if ((!d->progressive || ah == 0) && !d->huffman[0][scan[i]->dcTable].defined)
+			return false;
+		if (!d->progressive && !d->huffman[1][scan[i]->acTable].defined)
+			return false;
+		scan[i]->dcPrediction = 0;
+	}
+	d->bitBuffer = 0;
+	d->bitCount = 0;
+	d->marker = false;
+	d->padding = 0;
+	d->lumaDecoded = true;
+	return jpeg_scan(d, scan, count, ah, al);
+}
+
+// Works out every luma block's shrunk pixels from its low frequencies, the
+// same inverse DCT as for the whole block with blockSize points instead of 8
+Image jpeg_luma_image(JpegDecoder *d)
+{
+	int n = d->blockSize;
+	int scale = 8 / n;
+	float basis[8][8];
+	for (int x = 0; x < n; x++)
+	{
+		for (int u = 0; u < n; u++)
+		{
+			basis[x][u] = (u == 0 ? sqrt(0.5) : 1.0) * cos((2 * x + 1) * u * PI / (2 * n)) / 2;
+		}
+	}
+	Image image = {
+		.width = (d->width + scale - 1) / scale,
+		.height = (d->height + scale - 1) / scale,
+		.format = PIXELFORMAT_UNCOMPRESSED_GRAYSCALE,
+		.mipmaps = 1};
+	unsigned char *pixels = malloc((size_t)image.width * image.height);
+	if (pixels == NULL)
+	{
+		return (Image){0};
+	}
+	const uint16_t *quant = d->quant[d->components[0].quant];
+	for (int by = 0; by * n < image.height; by++)
+	{
+		for (int bx = 0; bx * n < image.width; bx++)
+		{
+			const int *block = d->coefficients + ((size_t)by * d->blocksAcross + bx) * n * n;
+			for (int y = 0; y < n && by * n + y < image.height; y++)
+			{
+				for (int x = 0; x < n && bx * n + x < image.width; x++)
+				{
+					float sum = 0;
+					for (int v = 0; v < n; v++)
+					{
+						for (int u = 0; u < n; u++)
+						{
+							sum += basis[y][v] * basis[x][u] * block[v * n + u] * quant[v * 8 + u];
+						}
+					}
+					int value = (int)lroundf(sum) + 128;
+					pixels[(size_t)(by * n + y) * image.width + bx * n + x] = value < 0 ? 0 : value > 255 ? 255 : value;
+				}
+			}
+		}
+	}
+	image.data = pixels;
+	return image;
+}
+
+// Reads the markers of a JPEG file and decodes the scans with luma in them
+bool jpeg_decode_file(JpegDecoder *d)
+{
+	if (d->size < 4 || d->data[0] != 0xFF || d->data[1] != 0xD8)
+	{
+		return false;
+	}
+	d->pos = 2;
+	for (;;)
+	{
+		while (d->pos < d->size && d->data[d->pos] != 0xFF)
+			d->pos++;
+		while (d->pos < d->size && d->data[d->pos] == 0xFF)
+			d->pos++;
+		if (d->pos >= d->size)
+		{
+			return false;
+		}
+		int marker = d->data[d->pos++];
+		if (marker == 0xD9)
+		{
+			break;
+		}
+		if ((marker >= 0xD0 && marker <= 0xD7) || marker == 0x01)
+		{
+			continue;
+		}
+		size_t length = d->pos + 2 <= d->size ? d->data[d->pos] << 8 | d->data[d->pos + 1] : 0;
+		if (length < 2 || d->pos + length > d->size)
+		{
+			return false;
+		}
+		const unsigned char *segment = d->data + d->pos + 2;
+		length -= 2;
+		size_t next = d->pos + 2 + length;
+		if (marker == 0xDB)
+		{
+			// Quantization tables, 8 or 16 bit values
+			while (length > 0)
+			{
+				int wide = segment[0] >> 4;
+				int id = segment[0] & 15;
+				size_t tableLength = 1 + 64 * (wide ? 2 : 1);
+				if (id > 3 || wide > 1 || length < tableLength)
+					return false;
+				for (int i = 0; i < 64; i++)
+					d->quant[id][jpegZigzag[i]] = wide ? segment[1 + 2 * i] << 8 | segment[2 + 2 * i] : segment[1 + i];
+				segment += tableLength;
+				length -= tableLength;
+			}
+		}
+		else if (marker == 0xC4)
+		{
+			// Huffman tables
+			while (length > 0)
+			{
+				int tableClass = segment[0] >> 4;
+				int id = segment[0] & 15;
+				int total = 0;
+				if (tableClass > 1 || id > 3 || length < 17)
+					return false;
+				for (int i = 0; i < 16; i++)
+					total += segment[1 + i];
+				if (total > 256 || length < 17 + (size_t)total || !build_jpeg_huffman(&d->huffman[tableClass][id], segment + 1, segment + 17))
+					return false;
+				segment += 17 + total;
+				length -= 17 + total;
+			}
+		}
+		else if (marker == 0xC0 || marker == 0xC1 || marker == 0xC2)
+		{
+			d->progressive = marker == 0xC2;
+			if (!jpeg_frame(d, segment, length))
+				return false;
+		}
+		else if (marker == 0xDD && length >= 2)
+		{
+			d->restartInterval = segment[0] << 8 | segment[1];
+		}
+		else if (marker == 0xDA)
+		{
+			d->pos = next;
+			if (!jpeg_start_scan(d, segment, length))
+				return false;
+			jpeg_skip_to_marker(d);
+			continue;
+		}
+		else if (marker == 0xEE && length >= 12 && memcmp(segment, "Adobe", 5) == 0 && segment[11] == 0)
+		{
+			// Adobe's flag for three components being RGB instead of YCbCr
+			return false;
+		}
+		else if (marker >= 0xC3 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+		{
+			// Lossless, hierarchical and arithmetic coded frames
+			return false;
+		}
+		d->pos = next;
+	}
+	return d->lumaDecoded;
+}
+
+// The grayscale image the hash of a JPEG is taken from, an invalid image for
+// data that isn't a JPEG this can decode
+Image decode_jpeg_luma(const unsigned char *data, size_t size)
+{
+	JpegDecoder *d = calloc(1, sizeof(JpegDecoder));
+	d->data = data;
+	d->size = size;
+	Image image = {0};
+	if (jpeg_decode_file(d))
+	{
+		image = jpeg_luma_image(d);
+	}
+	free(d->coefficients);
+	free(d);
+	return image;
+}
+
+Image load_jpeg_luma(const char *path)
+{
+	size_t size = 0;
+	unsigned char *data = map_file(path, &size);
+	if (data == NULL)
+	{
+		return (Image){0};
+	}
+	Image image = decode_jpeg_luma(data, size);
+	unmap_file(data, size);
+	return image;
+}
+
+// The image to hash path from, shrunk while decoding where possible
+Image load_hash_image(const char *path)
+{
+	Image image = load_jpeg_luma(path);
+	if (!IsImageValid(image))
+	{
+		image = LoadImage(path);
+	}
+	return image;
+}
+
+void insertImageNode(ImageNode *root, ImageNode *newNode)
+{
+	ImageNode *curr = root;
+	while (curr != NULL)
+	{
+		int distance = __builtin_popcount(curr->hash ^ newNode->hash);
+		int index = distance % HASH_SIZE;
+		ImageNode *next = curr->children[index];
+		if (next == NULL)
+		{
+			curr->children[index] = newNode;
+			break;
+		}
+		curr = next;
+	}
+}
+
+// results is replaced with the paths of the matches, closest first
+void searchImages(ImageNode *root, Image image, const char *path, int radius, int max, CharStack *results)
+{
+	results->len = 0;
+	if (root == NULL)
+	{
+		return;
+	}
+	unsigned long long int searchHash = dctTransform(image, path);
+
+	ImageNodeStack stack = {0};
+	push_image_node(&stack, root);
+	CharStack *potential = calloc(radius + 1, sizeof(CharStack));
+	while (stack.count > 0)
+	{
+		ImageNode *curr = pop_image_node(&stack);
+		int distance = __builtin_popcount(curr->hash ^ searchHash);
+		if (distance <= radius)
+		{
+			push_char(&potential[distance], curr->path);
+		}
+		int lower = fmax(distance - radius, 0);
+		int upper = min(distance + radius, HASH_SIZE - 1);
+		for (int i = lower; i <= upper; i++)
+		{
+			if (curr->children[i])
+			{
+				push_image_node(&stack, curr->children[i]);
+			}
+		}
+	}
+	collect_results(potential, radius, max, results);
+	for (int i = 0; i <= radius; i++)
+	{
+		free_chars(&potential[i]);
+	}
+	free(potential);
+	free_image_stack(&stack);
+}
+
+// How many files the image workers can get ahead of the one being inserted
+#define IMAGE_QUEUE_SIZE 64
+
+// A file the workers are done with, waiting to go into the tree
+typedef struct HashedImage
+{
+	unsigned long long int hash;
+	bool valid;
+	bool ready;
+} HashedImage;
+
+// Decoding and hashing the files runs on a pool of workers, which put the
+// hashes in a ring of slots by file. The thread building the tree takes them
+// out in file order, so the tree comes out the same for any number of threads
+typedef struct ImagePipeline
+{
+	FilePathList files;
+	HashedImage slots[IMAGE_QUEUE_SIZE];
+	// Next file a worker takes and next one to go into the tree
+	unsigned int nextFile;
+	unsigned int nextInsert;
+	// Workers still running, the last one out wakes the inserter
+	int workers;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	bool *kill;
+} ImagePipeline;
+
+void *hash_images_worker(void *args)
+{
+	ImagePipeline *pipeline = args;
+	pthread_mutex_lock(&pipeline->lock);
+	while (!__atomic_load_n(pipeline->kill, __ATOMIC_RELAXED) && pipeline->nextFile < pipeline->files.count)
+	{
+		// Waits for a free slot while the inserter is a whole ring behind
+		if (pipeline->nextFile >= pipeline->nextInsert + IMAGE_QUEUE_SIZE)
+		{
+			pthread_cond_wait(&pipeline->wake, &pipeline->lock);
+			continue;
+		}
+		unsigned int file = pipeline->nextFile++;
+		pthread_mutex_unlock(&pipeline->lock);
+		HashedImage hashed = {.ready = true};
+		Image image = load_hash_image(pipeline->files.paths[file]);
+		if (IsImageValid(image))
+		{
+			hashed.hash = dctTransform(image, pipeline->files.paths[file]);
+			hashed.valid = true;
+		}
+		UnloadImage(image);
+		pthread_mutex_lock(&pipeline->lock);
+		pipeline->slots[file % IMAGE_QUEUE_SIZE] = hashed;
+		pthread_cond_broadcast(&pipeline->wake);
+	}
+	pipeline->workers--;
+	pthread_cond_broadcast(&pipeline->wake);
+	pthread_mutex_unlock(&pipeline->lock);
+	return NULL;
+}
+
+// Builds the tree of every image in files on threads workers, the first
+// valid one becomes the root. completed counts the files done so far
+void index_image_files(ImageNode **root, FilePathList files, int threads, size_t *completed, bool *kill)
+{
+	ImagePipeline pipeline = {.files = files, .workers = threads, .kill = kill};
+	pthread_mutex_init(&pipeline.lock, NULL);
+	pthread_cond_init(&pipeline.wake, NULL);
+	pthread_t *workers = malloc(threads * sizeof(pthread_t));
+	for (int i = 0; i < threads; i++)
+	{
+		pthread_create(&workers[i], NULL, hash_images_worker, &pipeline);
+	}
+	pthread_mutex_lock(&pipeline.lock);
+	while (pipeline.nextInsert < files.count && !__atomic_load_n(kill, __ATOMIC_RELAXED))
+	{
+		HashedImage *slot = &pipeline.slots[pipeline.nextInsert % IMAGE_QUEUE_SIZE];
+		if (!slot->ready)
+		{
+			// Nothing left to wait for once the workers have stopped
+			if (pipeline.workers == 0)
+				break;
+			pthread_cond_wait(&pipeline.wake, &pipeline.lock);
+			continue;
+		}
+		HashedImage hashed = *slot;
+		slot->ready = false;
+		unsigned int file = pipeline.nextInsert++;
+		pthread_cond_broadcast(&pipeline.wake);
+		pthread_mutex_unlock(&pipeline.lock);
+		if (hashed.valid)
+		{
+			ImageNode *node = createImageNodeWithHash(files.paths[file], hashed.hash);
+			if (*root == NULL)
+				*root = node;
+			else
+				insertImageNode(*root, node);
+		}
+		else
+		{
+			printf("Invalid image provided: %s\n", files.paths[file]);
+		}
+		*completed = file + 1;
+		pthread_mutex_lock(&pipeline.lock);
+	}
+	pthread_cond_broadcast(&pipeline.wake);
+	pthread_mutex_unlock(&pipeline.lock);
+	for (int i = 0; i < threads; i++)
+	{
+		pthread_join(workers[i], NULL);
+	}
+	free(workers);
+	pthread_mutex_destroy(&pipeline.lock);
+	pthread_cond_destroy(&pipeline.wake);
+}
+
+void *index_images(void *args)
+{
+	struct ImageIndexArguments *arguments = args;
+
+	ImageNode **root = arguments->root;
+	if (!DirectoryExists("images"))
+	{
+		printf("No image directory\n");
+		*arguments->done = true;
+		pthread_exit(0);
+	}
+	FilePathList imageDirFiles = LoadDirectoryFiles("images");
+	if (imageDirFiles.count < 1)
+	{
+		printf("No images found\n");
+		*arguments->done = true;
+		UnloadDirectoryFiles(imageDirFiles);
+		pthread_exit(0);
+	}
+	*(arguments->total) = imageDirFiles.count;
+	index_image_files(root, imageDirFiles, cpu_count(), arguments->completed, arguments->kill);
+	if (*root == NULL)
+	{
+		printf("No valid images found\n");
+	}
+	UnloadDirectoryFiles(imageDirFiles);
+	*arguments->done = true;
+	pthread_exit(0);
+}
+
+void serializeImages(ImageNode *root, FILE *fp)
+{
+	if (root == NULL)
+	{
+		return;
+	}
+
+	fprintf(fp, "%s %lld :::", root->path, root->hash);
+	for (int i = 0; i < HASH_SIZE; i++)
+	{
+		if (root->children[i])
+		{
+			fprintf(fp, "%d --", i);
+			serializeImages(root->children[i], fp);
+		}
+	}
+	fprintf(fp, "%s :::", MARKER);
+}
+
+void writeImages(ImageNode *root)
+{
+	FILE *file = fopen("imagetree.bin", "wb");
+	if (file != NULL)
+	{
+		serializeImages(root, file);
+		fclose(file);
+	}
+}
+
+void deserializeImages(ImageNode **root, FILE *fp, size_t *completed, bool *kill)
+{
+	char val[128];
+	unsigned long long int hash;
+	if (!fscanf(fp, "%s %lld :::", (char *)&val, &hash) || strcmp(val, MARKER) == 0)
+		return;
+
+	// Else create node with this item and recur for children
+	*root = createImageNodeWithHash(val, hash);
+	*completed = ftell(fp);
+	int idx;
+	while (fscanf(fp, "%d --", &idx) && !*kill)
+	{
+		deserializeImages(&(*root)->children[idx], fp, completed, kill);
+	}
+	if (*kill)
 	{
 		return;
 	}
+	fscanf(fp, "%s :::", (char *)&val);
+	if (strcmp(val, MARKER) != 0)
+	{
+		exit(1);
+	}
+	// Finally return 0 for successful finish
+	return;
+}
+
+void readImages(ImageNode **root, size_t *total, size_t *completed, bool *kill)
+{
+	FILE *file = fopen("imagetree.bin", "r");
+	if (file != NULL)
+	{
+		fseek(file, 0, SEEK_END);
+		long fsize = ftell(file);
+		fseek(file, 0, SEEK_SET); /* same as rewind(f); */
+		*total = fsize;
+		deserializeImages(root, file, completed, kill);
+		fclose(file);
+		// print_tree(root);
+	}
+}
+
+void *loadImages(void *args)
+{
+	ImageIndexArguments *arguments = args;
+	readImages(arguments->root, arguments->total, arguments->completed, arguments->kill);
+	*arguments->done = true;
+	pthread_exit(0);
+}
+
+//------------------------------------------------------------------------------------
+// Benchmarks, run with --bench [name] from the directory holding words.txt
+// and images/
+//------------------------------------------------------------------------------------
+
+// Hardware cache miss counter for the calling thread, -1 when the platform or
+// its permissions don't allow one
+int open_cache_counter(void)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+void start_cache_counter(int fd)
+{
+#ifdef __linux__
+	if (fd >= 0)
+	{
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+
+long long stop_cache_counter(int fd)
+{
+	long long count = -1;
+#ifdef __linux__
+	if (fd >= 0)
+	{
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &count, sizeof(count)) != sizeof(count))
+			count = -1;
+	}
+#endif
+	return count;
+}
 
-	// Else, store current node and recur for its children
-	fprintf(fp, "%s :::", root->word);
-	for (int i = 0; i < MAX_CHAR; i++)
-		if (root->children[i])
+// Wall clock seconds, for timing things that run on several threads
+double now_seconds(void)
+{
+#ifdef _WIN32
+	// clock() is wall time on Windows
+	return (double)clock() / CLOCKS_PER_SEC;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+// Reads words.txt into memory, *string has to be freed along with the words
+char **bench_read_words(char **string, uint32_t *count)
+{
+	FILE *fp = fopen("words.txt", "rb");
+	if (fp == NULL)
+	{
+		printf("Couldn't open words.txt\n");
+		return NULL;
+	}
+	fseek(fp, 0, SEEK_END);
+	long fsize = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	*string = malloc(fsize + 1);
+	fread(*string, fsize, 1, fp);
+	(*string)[fsize] = 0;
+	fclose(fp);
+	return split_words(*string, count);
+}
+
+// Misspelled versions of every step-th word: a swap, a changed letter or a
+// dropped letter
+char **bench_queries(char **words, uint32_t total, int count)
+{
+	char **queries = malloc(count * sizeof(char *));
+	uint32_t step = total / count;
+	for (int i = 0; i < count; i++)
+	{
+		char *query = strdup(words[i * step]);
+		int len = strlen(query);
+		if (i % 3 == 0 && len > 2)
 		{
-			fprintf(fp, "%d --", i);
-			serialize(root->children[i], fp);
+			char c = query[1];
+			query[1] = query[2];
+			query[2] = c;
 		}
+		else if (i % 3 == 1)
+			query[len / 2] = 'a' + i % 26;
+		else if (len > 1)
+			query[len - 1] = '\0';
+		queries[i] = query;
+	}
+	return queries;
+}
 
-	// Store marker at the end of children
-	fprintf(fp, "%s :::", MARKER);
+void free_queries(char **queries, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		free(queries[i]);
+	}
+	free(queries);
 }
 
-void write_tree(Node *tree)
+// What most benchmarks start from: the words, count queries made from them, a
+// workspace and, when asked for, the tree built on every core and reordered
+typedef struct BenchFixture
 {
-	FILE *file = fopen("bktree.bin", "wb");
-	if (file != NULL)
+	char *string;
+	char **words;
+	uint32_t total;
+	char **queries;
+	int count;
+	WordTree tree;
+	DistanceWorkspace ws;
+} BenchFixture;
+
+// Returns false, with nothing to tear down, if words.txt can't be read
+bool bench_setup(BenchFixture *fixture, int count, bool build)
+{
+	fixture->words = bench_read_words(&fixture->string, &fixture->total);
+	if (fixture->words == NULL)
 	{
-		serialize(tree, file);
-		fclose(file);
+		return false;
+	}
+	fixture->count = count;
+	fixture->queries = bench_queries(fixture->words, fixture->total, count);
+	init_workspace(&fixture->ws);
+	init_tree(&fixture->tree);
+	if (build)
+	{
+		size_t completed = 0;
+		bool kill = false;
+		build_tree_parallel(&fixture->tree, fixture->words, fixture->total, cpu_count(), &completed, &kill);
+		reorder_tree(&fixture->tree);
 	}
+	return true;
 }
 
-void deSerialize(Node **root, FILE *fp, size_t *completed, bool *kill)
+void bench_teardown(BenchFixture *fixture)
 {
-	// Read next item from file. If there are no more items or next
-	// item is marker, then return 1 to indicate same
-	char val[128];
-	if (!fscanf(fp, "%s :::", (char *)&val) || strcmp(val, MARKER) == 0)
-		return;
+	free_queries(fixture->queries, fixture->count);
+	free_workspace(&fixture->ws);
+	free_tree(&fixture->tree);
+	free(fixture->words);
+	free(fixture->string);
+}
 
-	// Else create node with this item and recur for children
-	*root = createNode(val);
-	*completed = ftell(fp);
-	int idx;
-	while (fscanf(fp, "%d --", &idx) && !*kill)
+// Runs every query once and prints the time, cache misses and result count
+void bench_search(WordTree *tree, char **queries, int count, int radius, const char *label)
+{
+	DistanceWorkspace ws;
+	init_workspace(&ws);
+	int counter = open_cache_counter();
+	CharStack found = {0};
+	long results = 0;
+	start_cache_counter(counter);
+	double start = now_seconds();
+	for (int i = 0; i < count; i++)
 	{
-		deSerialize(&(*root)->children[idx], fp, completed, kill);
+		search(tree, queries[i], radius, INT_MAX, &ws, &found);
+		results += found.len;
 	}
-	if (*kill)
+	double seconds = now_seconds() - start;
+	long long misses = stop_cache_counter(counter);
+	if (counter >= 0)
+		close(counter);
+	if (misses >= 0)
+		printf("%-16s radius %d %8.3f ms/query %10lld cache misses/query %8ld results\n", label, radius, seconds * 1000 / count, misses / count, results);
+	else
+		printf("%-16s radius %d %8.3f ms/query %10s cache misses/query %8ld results\n", label, radius, seconds * 1000 / count, "n/a", results);
+	free_chars(&found);
+	free_workspace(&ws);
+}
+
+// Search on the tree as inserted against after reorder_tree
+void bench_layout(void)
+{
+	BenchFixture fixture;
+	if (!bench_setup(&fixture, 300, false))
 	{
 		return;
 	}
-	fscanf(fp, "%s :::", (char *)&val);
-	if (strcmp(val, MARKER) != 0)
+	WordTree *tree = &fixture.tree;
+	// Plain inserts in file order, without the parallel build's layout
+	for (uint32_t i = 0; i < fixture.total; i++)
 	{
-		exit(1);
+		insert(tree, fixture.words[i], &fixture.ws);
 	}
-	// Finally return 0 for successful finish
-	return;
+	for (int radius = 1; radius <= 2; radius++)
+	{
+		bench_search(tree, fixture.queries, fixture.count, radius, "insertion order");
+	}
+	reorder_tree(tree);
+	for (int radius = 1; radius <= 2; radius++)
+	{
+		bench_search(tree, fixture.queries, fixture.count, radius, "breadth first");
+	}
+	bench_teardown(&fixture);
 }
 
-void print_tree(Node *root)
+// Parallel build with more and more threads, checking each gives the same
+// tree as one thread
+void bench_build(void)
 {
-	printf("%s -- \n", root->word);
-	for (int i = 0; i < MAX_CHAR; i++)
+	char *string;
+	uint32_t count;
+	char **words = bench_read_words(&string, &count);
+	if (words == NULL)
 	{
-		if (root->children[i])
+		return;
+	}
+	WordTree single;
+	init_tree(&single);
+	int most = max(cpu_count(), 4);
+	printf("%u words, %d cores\n", count, cpu_count());
+	for (int threads = 1; threads <= most; threads *= 2)
+	{
+		WordTree tree;
+		init_tree(&tree);
+		size_t completed = 0;
+		bool kill = false;
+		double start = now_seconds();
+		build_tree_parallel(&tree, words, count, threads, &completed, &kill);
+		double seconds = now_seconds() - start;
+		reorder_tree(&tree);
+		if (threads == 1)
 		{
-			printf("%d. ", i);
-			print_tree(root->children[i]);
+			single = tree;
+			printf("%2d threads %8.3f s\n", threads, seconds);
+			continue;
 		}
+		bool same = tree.count == single.count && tree.wordsLength == single.wordsLength &&
+					memcmp(tree.nodes, single.nodes, tree.count * sizeof(Node)) == 0 &&
+					memcmp(tree.words, single.words, tree.wordsLength) == 0;
+		printf("%2d threads %8.3f s %s\n", threads, seconds, same ? "same tree" : "DIFFERENT TREE");
+		free_tree(&tree);
 	}
+	free_tree(&single);
+	free(words);
+	free(string);
 }
 
-void read_tree(Node **root, size_t *total, size_t *completed, bool *kill)
+// Searches in a loop while create_tree runs, the way the GUI can during a
+// build, and prints how much of the tree and the final results each round saw
+void bench_warmup(void)
 {
-	FILE *file = fopen("bktree.bin", "r");
-	if (file != NULL)
+	BenchFixture fixture;
+	if (!bench_setup(&fixture, 20, false))
 	{
-		fseek(file, 0, SEEK_END);
-		long fsize = ftell(file);
-		fseek(file, 0, SEEK_SET); /* same as rewind(f); */
-		*total = fsize;
-		deSerialize(root, file, completed, kill);
-		fclose(file);
-		// print_tree(root);
+		return;
+	}
+	WordTree *tree = &fixture.tree;
+	DistanceWorkspace *ws = &fixture.ws;
+	char **queries = fixture.queries;
+	int count = fixture.count;
+	int radius = 1;
+	size_t indexTotal = 0, completed = 0;
+	bool done = false, kill = false;
+	IndexingArguments arguments = {.tree = tree, .total = &indexTotal, .completed = &completed, .done = &done, .kill = &kill};
+	pthread_t thread;
+	double start = now_seconds();
+	pthread_create(&thread, NULL, create_tree, &arguments);
+	bool finished = false;
+	double lastPrint = -1;
+	CharStack found = {0};
+	while (!finished)
+	{
+		finished = __atomic_load_n(&done, __ATOMIC_ACQUIRE);
+		uint32_t nodes = tree_count(tree);
+		long results = 0;
+		double roundStart = now_seconds();
+		for (int i = 0; i < count; i++)
+		{
+			search(tree, queries[i], radius, INT_MAX, ws, &found);
+			results += found.len;
+		}
+		double now = now_seconds();
+		if (now - lastPrint >= 0.2 || finished)
+		{
+			lastPrint = now;
+			printf("%7.3f s %8u nodes %6ld results %8.3f ms/query%s\n", now - start, nodes, results, (now - roundStart) * 1000 / count, finished ? " (done)" : "");
+		}
 	}
+	pthread_join(thread, NULL);
+	free_chars(&found);
+	bench_teardown(&fixture);
 }
 
-void *load_tree(void *args)
+int compare_words(const void *a, const void *b)
 {
-	LoadingArguments *arguments = args;
-	read_tree(arguments->root, arguments->total, arguments->completed, arguments->kill);
-	*arguments->done = true;
-	pthread_exit(0);
+	return strcmp(*(char *const *)a, *(char *const *)b);
 }
 
-unsigned long long int dctTransform(Image image)
+// Whether a and b hold the same words, in any order
+bool same_words(const CharStack *a, const CharStack *b)
 {
-	int n = 32, m = 32;
-	Image copy = ImageCopy(image);
-	ImageResize(&copy, n, m);
-	ImageColorGrayscale(&copy);
-	unsigned char *matrix = copy.data;
-	int i, j, k, l;
+	if (a->len != b->len)
+	{
+		return false;
+	}
+	char **x = malloc((a->len + 1) * sizeof(char *));
+	char **y = malloc((b->len + 1) * sizeof(char *));
+	memcpy(x, a->words, a->len * sizeof(char *));
+	memcpy(y, b->words, b->len * sizeof(char *));
+	qsort(x, a->len, sizeof(char *), compare_words);
+	qsort(y, b->len, sizeof(char *), compare_words);
+	bool same = true;
+	for (int i = 0; same && i < a->len; i++)
+	{
+		same = strcmp(x[i], y[i]) == 0;
+	}
+	free(x);
+	free(y);
+	return same;
+}
 
-	// dct will store the discrete cosine transform
-	float dct[n][m];
+// search against search_parallel at large radii, for a few thread counts and
+// grain sizes, checking they find the same words
+void bench_parallel_search(void)
+{
+	BenchFixture fixture;
+	if (!bench_setup(&fixture, 20, true))
+	{
+		return;
+	}
+	WordTree *tree = &fixture.tree;
+	DistanceWorkspace *ws = &fixture.ws;
+	char **queries = fixture.queries;
+	int count = fixture.count;
+	int grains[] = {8, SEARCH_GRAIN, 256};
+	CharStack *expected = calloc(count, sizeof(CharStack));
+	CharStack found = {0};
+	printf("%d cores\n", cpu_count());
+	for (int radius = 2; radius <= 4; radius++)
+	{
+		double start = now_seconds();
+		for (int i = 0; i < count; i++)
+		{
+			search(tree, queries[i], radius, INT_MAX, ws, &expected[i]);
+		}
+		printf("radius %d serial               %8.3f ms/query\n", radius, (now_seconds() - start) * 1000 / count);
+		for (int threads = 2; threads <= max(cpu_count(), 4); threads *= 2)
+		{
+			for (size_t g = 0; g < sizeof(grains) / sizeof(grains[0]); g++)
+			{
+				bool same = true;
+				double seconds = 0;
+				for (int i = 0; i < count; i++)
+				{
+					start = now_seconds();
+					search_parallel(tree, queries[i], radius, INT_MAX, threads, grains[g], &found);
+					seconds += now_seconds() - start;
+					same = same && same_words(&found, &expected[i]);
+				}
+				printf("radius %d %2d threads grain %3d %8.3f ms/query %s\n", radius, threads, grains[g], seconds * 1000 / count, same ? "same results" : "DIFFERENT RESULTS");
+			}
+		}
+	}
+	for (int i = 0; i < count; i++)
+	{
+		free_chars(&expected[i]);
+	}
+	free(expected);
+	free_chars(&found);
+	bench_teardown(&fixture);
+}
 
-	float ci, cj, dct1, sum;
+// Queries per second for search in a loop against search_batch on one
+// thread and on every core, checking the batch finds the same words. Runs on
+// distinct queries and on a set where each query comes up 4 times, like words
+// in a document do
+void bench_batch(void)
+{
+	BenchFixture fixture;
+	if (!bench_setup(&fixture, 2000, true))
+	{
+		return;
+	}
+	WordTree *tree = &fixture.tree;
+	DistanceWorkspace *ws = &fixture.ws;
+	char **queries = fixture.queries;
+	int count = fixture.count;
+	char **repeated = malloc(count * sizeof(char *));
+	for (int i = 0; i < count; i++)
+	{
+		repeated[i] = queries[i % (count / 4)];
+	}
+	char **sets[] = {queries, repeated};
+	const char *setNames[] = {"distinct", "repeated"};
+	CharStack *expected = calloc(count, sizeof(CharStack));
+	CharStack *found = calloc(count, sizeof(CharStack));
+	printf("%d queries, %d cores\n", count, cpu_count());
+	for (int radius = 1; radius <= 2; radius++)
+	{
+		for (int set = 0; set < 2; set++)
+		{
+			double start = now_seconds();
+			for (int i = 0; i < count; i++)
+			{
+				search(tree, sets[set][i], radius, INT_MAX, ws, &expected[i]);
+			}
+			printf("radius %d %-8s search loop      %10.0f queries/s\n", radius, setNames[set], count / (now_seconds() - start));
+			int runs[] = {1, cpu_count()};
+			// One row when there's only the one core
+			for (int r = 0; r < (runs[1] > 1 ? 2 : 1); r++)
+			{
+				start = now_seconds();
+				search_batch(tree, sets[set], count, radius, INT_MAX, runs[r], found);
+				double seconds = now_seconds() - start;
+				bool same = true;
+				for (int i = 0; i < count; i++)
+				{
+					same = same && same_words(&found[i], &expected[i]);
+				}
+				printf("radius %d %-8s batch %2d threads %10.0f queries/s %s\n", radius, setNames[set], runs[r], count / seconds, same ? "same results" : "DIFFERENT RESULTS");
+			}
+		}
+	}
+	for (int i = 0; i < count; i++)
+	{
+		free_chars(&expected[i]);
+		free_chars(&found[i]);
+	}
+	free(expected);
+	free(found);
+	free(repeated);
+	bench_teardown(&fixture);
+}
 
-	for (i = 0; i < m; i++)
+// search_nearest for the 10 closest words against a full search of the
+// radius ball cut to 10, checking both give the same distances
+void bench_nearest(void)
+{
+	BenchFixture fixture;
+	if (!bench_setup(&fixture, 20, true))
 	{
-		for (j = 0; j < n; j++)
+		return;
+	}
+	WordTree *tree = &fixture.tree;
+	DistanceWorkspace *ws = &fixture.ws;
+	char **queries = fixture.queries;
+	int count = fixture.count;
+	CharStack found = {0}, expected = {0};
+	for (int radius = 2; radius <= 4; radius++)
+	{
+		double searchSeconds = 0, nearestSeconds = 0;
+		bool same = true;
+		for (int i = 0; i < count; i++)
 		{
+			double start = now_seconds();
+			search(tree, queries[i], radius, NEAREST_COUNT, ws, &expected);
+			searchSeconds += now_seconds() - start;
+			start = now_seconds();
+			search_nearest(tree, queries[i], NEAREST_COUNT, radius, ws, &found);
+			nearestSeconds += now_seconds() - start;
+			same = same && found.len == expected.len;
+			for (int j = 0; same && j < found.len; j++)
+			{
+				same = damerau_levenshtein_distance_ws(ws, queries[i], found.words[j]) == damerau_levenshtein_distance_ws(ws, queries[i], expected.words[j]);
+			}
+		}
+		printf("radius %d search %8.3f ms/query nearest %d %8.3f ms/query %s\n", radius, searchSeconds * 1000 / count, NEAREST_COUNT, nearestSeconds * 1000 / count, same ? "same distances" : "DIFFERENT DISTANCES");
+	}
+	free_chars(&found);
+	free_chars(&expected);
+	bench_teardown(&fixture);
+}
 
-			// ci and cj depends on frequency as well as
-			// number of row and columns of specified matrix
-			if (i == 0)
-				ci = 1. / sqrt(m);
-			else
-				ci = sqrt(2. / m);
-			if (j == 0)
-				cj = 1. / sqrt(n);
-			else
-				cj = sqrt(2. / n);
+// What bench_stream's callback keeps track of
+typedef struct StreamTiming
+{
+	double start;
+	double first;
+	CharStack found;
+	int lastDistance;
+	bool ordered;
+} StreamTiming;
+
+bool time_stream(char *word, int distance, void *data)
+{
+	StreamTiming *timing = data;
+	if (timing->found.len == 0)
+		timing->first = now_seconds() - timing->start;
+	timing->ordered = timing->ordered && distance >= timing->lastDistance;
+	timing->lastDistance = distance;
+	push_char(&timing->found, word);
+	return true;
+}
+
+// How long search_stream takes to hand over its first match and all of them,
+// against search, checking it finds the same words closest first
+void bench_stream(void)
+{
+	BenchFixture fixture;
+	if (!bench_setup(&fixture, 20, true))
+	{
+		return;
+	}
+	WordTree *tree = &fixture.tree;
+	DistanceWorkspace *ws = &fixture.ws;
+	char **queries = fixture.queries;
+	int count = fixture.count;
+	CharStack expected = {0};
+	StreamTiming timing = {0};
+	bool kill = false;
+	for (int radius = 2; radius <= 4; radius++)
+	{
+		double searchSeconds = 0, firstSeconds = 0, streamSeconds = 0;
+		bool same = true;
+		for (int i = 0; i < count; i++)
+		{
+			double start = now_seconds();
+			search(tree, queries[i], radius, INT_MAX, ws, &expected);
+			searchSeconds += now_seconds() - start;
+			timing.found.len = 0;
+			timing.lastDistance = 0;
+			timing.ordered = true;
+			timing.start = now_seconds();
+			search_stream(tree, queries[i], radius, INT_MAX, ws, time_stream, &timing, &kill);
+			streamSeconds += now_seconds() - timing.start;
+			firstSeconds += timing.first;
+			same = same && timing.ordered && same_words(&timing.found, &expected);
+		}
+		printf("radius %d search %8.3f ms/query stream first %8.3f ms all %8.3f ms/query %s\n", radius, searchSeconds * 1000 / count, firstSeconds * 1000 / count, streamSeconds * 1000 / count, same ? "same results in order" : "DIFFERENT RESULTS");
+	}
+	free_chars(&timing.found);
+	free_chars(&expected);
+	bench_teardown(&fixture);
+}
 
-			// sum will temporarily store the sum of
-			// cosine signals
-			sum = 0;
-			for (k = 0; k < m; k++)
+// Types each query one character at a time and searches on every keystroke,
+// with search_trie against search, checking they find the same words
+void bench_typing(void)
+{
+	BenchFixture fixture;
+	if (!bench_setup(&fixture, 20, true))
+	{
+		return;
+	}
+	WordTree *tree = &fixture.tree;
+	DistanceWorkspace *ws = &fixture.ws;
+	char **queries = fixture.queries;
+	int count = fixture.count;
+	WordTrie trie;
+	init_trie(&trie);
+	double start = now_seconds();
+	build_trie(&trie, tree);
+	printf("trie of %u nodes built in %.3f s\n", trie.count, now_seconds() - start);
+	CharStack found = {0}, expected = {0};
+	for (int radius = 1; radius <= 2; radius++)
+	{
+		double searchSeconds = 0, trieSeconds = 0, slowest = 0;
+		int keystrokes = 0;
+		bool same = true;
+		for (int i = 0; i < count; i++)
+		{
+			char typed[128];
+			int len = strlen(queries[i]);
+			for (int j = 1; j <= len && j < (int)sizeof(typed); j++)
 			{
-				for (l = 0; l < n; l++)
-				{
-					dct1 = (int)matrix[(k * 32) + l] *
-						   cos((PI / m) * (k + .5) * i) *
-						   cos((PI / n) * (l + .5) * j);
-					sum += dct1;
-				}
+				memcpy(typed, queries[i], j);
+				typed[j] = '\0';
+				start = now_seconds();
+				search(tree, typed, radius, INT_MAX, ws, &expected);
+				searchSeconds += now_seconds() - start;
+				start = now_seconds();
+				search_trie(&trie, typed, radius, INT_MAX, ws, &found);
+				double seconds = now_seconds() - start;
+				trieSeconds += seconds;
+				slowest = fmax(slowest, seconds);
+				keystrokes++;
+				same = same && same_words(&found, &expected);
 			}
-			dct[i][j] = ci * cj * sum;
 		}
+		printf("radius %d search %8.3f ms/keystroke trie %8.3f ms/keystroke, slowest %8.3f ms %s\n", radius, searchSeconds * 1000 / keystrokes, trieSeconds * 1000 / keystrokes, slowest * 1000, same ? "same results" : "DIFFERENT RESULTS");
 	}
+	free_chars(&found);
+	free_chars(&expected);
+	free_trie(&trie);
+	bench_teardown(&fixture);
+}
 
-	float reducedDct[8][8];
-	float lowFreqTotal = 0.f;
-	// Reduce dct to 8x8 by taking top left to get lowest frequencies
-	for (i = 0; i < 8; i++)
+// Searches with and without the length and signature prefilter in expand_node
+// and reports how many distance computations it saved
+void bench_filter(void)
+{
+	BenchFixture fixture;
+	if (!bench_setup(&fixture, 20, true))
 	{
-		for (j = 1; j < 9; j++)
+		return;
+	}
+	WordTree *tree = &fixture.tree;
+	DistanceWorkspace *ws = &fixture.ws;
+	char **queries = fixture.queries;
+	int count = fixture.count;
+	CharStack found = {0}, expected = {0};
+	for (int radius = 1; radius <= 4; radius++)
+	{
+		double filteredSeconds = 0, fullSeconds = 0;
+		uint64_t filtered = 0, computed = 0;
+		bool same = true;
+		for (int i = 0; i < count; i++)
 		{
-			reducedDct[i][j - 1] = dct[i][j];
+			prefilterEnabled = false;
+			double start = now_seconds();
+			search(tree, queries[i], radius, INT_MAX, ws, &expected);
+			fullSeconds += now_seconds() - start;
+			prefilterEnabled = true;
+			ws->filtered = 0;
+			ws->computed = 0;
+			start = now_seconds();
+			search(tree, queries[i], radius, INT_MAX, ws, &found);
+			filteredSeconds += now_seconds() - start;
+			filtered += ws->filtered;
+			computed += ws->computed;
+			same = same && same_words(&found, &expected);
+		}
+		printf("radius %d %5.1f%% of %llu distances skipped, search %8.3f ms/query without filter %8.3f ms/query %s\n", radius,
+			   100.0 * filtered / fmax(filtered + computed, 1), (unsigned long long)(filtered + computed),
+			   filteredSeconds * 1000 / count, fullSeconds * 1000 / count, same ? "same results" : "DIFFERENT RESULTS");
+	}
+	free_chars(&found);
+	free_chars(&expected);
+	bench_teardown(&fixture);
+}
 
-			if (i == 0 && j == 0)
-				continue;
-			lowFreqTotal += dct[i][j];
+// Compares search with the deletes index built for each radius, which is all
+// it's searched with
+void bench_deletes(void)
+{
+	BenchFixture fixture;
+	if (!bench_setup(&fixture, 20, true))
+	{
+		return;
+	}
+	WordTree *tree = &fixture.tree;
+	DistanceWorkspace *ws = &fixture.ws;
+	char **queries = fixture.queries;
+	int count = fixture.count;
+	CharStack found = {0}, expected = {0};
+	DeleteIndex index;
+	init_delete_index(&index);
+	for (int radius = 1; radius <= DELETE_MAX_DISTANCE; radius++)
+	{
+		double start = now_seconds();
+		build_delete_index(&index, tree, radius);
+		double buildSeconds = now_seconds() - start;
+		size_t bytes = ((size_t)index.mask + 2 + index.count + tree->count) * sizeof(uint32_t);
+		double searchSeconds = 0, deletesSeconds = 0;
+		bool same = true;
+		for (int i = 0; i < count; i++)
+		{
+			start = now_seconds();
+			search(tree, queries[i], radius, INT_MAX, ws, &expected);
+			searchSeconds += now_seconds() - start;
+			start = now_seconds();
+			search_deletes(&index, queries[i], radius, INT_MAX, ws, &found);
+			deletesSeconds += now_seconds() - start;
+			same = same && same_words(&found, &expected);
 		}
+		printf("radius %d index of %zu deletes, %.1f MB, built in %.3f s, search %8.3f ms/query deletes %8.3f ms/query %s\n", radius, index.count,
+			   bytes / 1e6, buildSeconds, searchSeconds * 1000 / count, deletesSeconds * 1000 / count, same ? "same results" : "DIFFERENT RESULTS");
 	}
+	free_delete_index(&index);
+	free_chars(&found);
+	free_chars(&expected);
+	bench_teardown(&fixture);
+}
 
-	float avg = lowFreqTotal / 64;
-	unsigned long long int result = 0;
-	for (i = 0; i < 8; i++)
+// Hashes every image in images/, first from the fully decoded file, then the
+// way indexing does with JPEGs decoded shrunk, then only from the grayscale
+// pixels with each DCT kernel the CPU has
+void bench_hash(void)
+{
+	if (!DirectoryExists("images"))
+	{
+		printf("No image directory\n");
+		return;
+	}
+	FilePathList files = LoadDirectoryFiles("images");
+	unsigned char(*pixels)[DCT_SIZE * DCT_SIZE] = malloc(files.count * sizeof(*pixels));
+	unsigned long long int *hashes = malloc(files.count * sizeof(unsigned long long int));
+	int count = 0;
+	double fileSeconds = 0;
+	double shrunkSeconds = 0;
+	size_t fileBytes = 0;
+	size_t shrunkBytes = 0;
+	int differentBits = 0;
+	int mostBits = 0;
+	for (unsigned int i = 0; i < files.count; i++)
+	{
+		double start = now_seconds();
+		Image image = LoadImage(files.paths[i]);
+		if (!IsImageValid(image))
+		{
+			UnloadImage(image);
+			continue;
+		}
+		hashes[count] = dctTransform(image, files.paths[i]);
+		fileSeconds += now_seconds() - start;
+		fileBytes += GetPixelDataSize(image.width, image.height, image.format);
+		Image input = dct_input(image);
+		memcpy(pixels[count], input.data, sizeof(pixels[count]));
+		UnloadImage(input);
+		UnloadImage(image);
+
+		start = now_seconds();
+		Image shrunk = load_hash_image(files.paths[i]);
+		unsigned long long int hash = dctTransform(shrunk, files.paths[i]);
+		shrunkSeconds += now_seconds() - start;
+		shrunkBytes += GetPixelDataSize(shrunk.width, shrunk.height, shrunk.format);
+		UnloadImage(shrunk);
+		int bits = __builtin_popcountll(hash ^ hashes[count]);
+		differentBits += bits;
+		mostBits = max(mostBits, bits);
+		count++;
+	}
+	UnloadDirectoryFiles(files);
+	printf("%d images, %10.1f hashes/s from the files, %.1f MB decoded\n", count, count / fmax(fileSeconds, 1e-9), fileBytes / 1e6);
+	printf("%10.1f hashes/s decoding JPEGs shrunk, %.1f MB decoded, hashes %.2f bits apart on average and %d at most\n",
+		   count / fmax(shrunkSeconds, 1e-9), shrunkBytes / 1e6, (double)differentBits / fmax(count, 1), mostBits);
+	// The transform from before it was table driven, which the kernels have to
+	// hash exactly like
+	bool same = true;
+	double start = now_seconds();
+	for (int i = 0; i < count; i++)
+	{
+		same = original_dct_hash(pixels[i]) == hashes[i] && same;
+	}
+	double seconds = now_seconds() - start;
+	printf("%-8s %10.0f hashes/s from the pixels %s\n", "original", count / fmax(seconds, 1e-9), same ? "same hashes" : "DIFFERENT HASHES");
+	pthread_once(&dctOnce, init_dct);
+	DctKernel selected = dctKernel;
+	DctKernel kernels[] = {dct_hash_block_scalar, selected};
+	const char *names[] = {"scalar", selected == dct_hash_block_scalar ? NULL : "avx"};
+	int rounds = 20;
+	for (int k = 0; k < 2; k++)
+	{
+		if (names[k] == NULL)
+		{
+			continue;
+		}
+		dctKernel = kernels[k];
+		same = true;
+		float dct[DCT_SIZE][DCT_SIZE];
+		float average;
+		start = now_seconds();
+		for (int r = 0; r < rounds; r++)
+		{
+			for (int i = 0; i < count; i++)
+			{
+				same = dct_hash(pixels[i], dct, &average) == hashes[i] && same;
+			}
+		}
+		seconds = now_seconds() - start;
+		printf("%-8s %10.0f hashes/s from the pixels %s\n", names[k], rounds * count / fmax(seconds, 1e-9), same ? "same hashes" : "DIFFERENT HASHES");
+	}
+	dctKernel = selected;
+	free(pixels);
+	free(hashes);
+}
+
+bool same_image_tree(const ImageNode *a, const ImageNode *b)
+{
+	if (a == NULL || b == NULL)
+	{
+		return a == b;
+	}
+	if (a->hash != b->hash || strcmp(a->path, b->path) != 0)
+	{
+		return false;
+	}
+	for (int i = 0; i < HASH_SIZE; i++)
+	{
+		if (!same_image_tree(a->children[i], b->children[i]))
+			return false;
+	}
+	return true;
+}
+
+// Indexes images/ on 1, 2, 4... threads and checks they all build the same tree
+void bench_images(void)
+{
+	if (!DirectoryExists("images"))
+	{
+		printf("No image directory\n");
+		return;
+	}
+	FilePathList files = LoadDirectoryFiles("images");
+	ImageNode *single = NULL;
+	int most = max(cpu_count(), 4);
+	double results[32];
+	bool same[32];
+	int runs = 0;
+	for (int threads = 1; threads <= most; threads *= 2)
+	{
+		ImageNode *root = NULL;
+		size_t completed = 0;
+		bool kill = false;
+		double start = now_seconds();
+		index_image_files(&root, files, threads, &completed, &kill);
+		results[runs] = now_seconds() - start;
+		same[runs] = completed == files.count && (threads == 1 || same_image_tree(root, single));
+		runs++;
+		if (threads == 1)
+			single = root;
+		else
+			freeImageNode(root);
+	}
+	// After the indexing so its output doesn't bury these
+	printf("%u files, %d cores\n", files.count, cpu_count());
+	for (int i = 0, threads = 1; i < runs; i++, threads *= 2)
+	{
+		printf("%2d threads %8.3f s %8.1f images/s %s\n", threads, results[i], files.count / fmax(results[i], 1e-9), same[i] ? "same tree" : "DIFFERENT TREE");
+	}
+	freeImageNode(single);
+	UnloadDirectoryFiles(files);
+}
+
+typedef struct Benchmark
+{
+	const char *name;
+	void (*run)(void);
+} Benchmark;
+
+Benchmark benchmarks[] = {
+	{"layout", bench_layout},
+	{"build", bench_build},
+	{"warmup", bench_warmup},
+	{"search", bench_parallel_search},
+	{"batch", bench_batch},
+	{"nearest", bench_nearest},
+	{"stream", bench_stream},
+	{"typing", bench_typing},
+	{"filter", bench_filter},
+	{"deletes", bench_deletes},
+	{"hash", bench_hash},
+	{"images", bench_images},
+};
+
+// Runs the benchmark called name, or all of them when name is NULL
+int run_benchmarks(const char *name)
+{
+	bool found = false;
+	for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++)
+	{
+		if (name == NULL || strcmp(name, benchmarks[i].name) == 0)
+		{
+			printf("== %s ==\n", benchmarks[i].name);
+			benchmarks[i].run();
+			found = true;
+		}
+	}
+	if (!found)
+	{
+		printf("Unknown benchmark %s\n", name);
+		return 1;
+	}
+	return 0;
+}
+
+// Optimal string alignment distance straight from its recurrence, for checking
+// the bit-parallel engines. d has to hold (len_a + 1) * (len_b + 1) ints
+int osa_distance_dp(int *d, const char *a, int len_a, const char *b, int len_b)
+{
+	int cols = len_b + 1;
+	for (int i = 0; i <= len_a; i++)
+		d[i * cols] = i;
+	for (int j = 0; j <= len_b; j++)
+		d[j] = j;
+	for (int i = 1; i <= len_a; i++)
 	{
-		for (j = 0; j < 8; j++)
+		for (int j = 1; j <= len_b; j++)
 		{
-			if (reducedDct[i][j] > avg)
-				result |= 1;
-			result = result << 1;
+			int cost = a[i - 1] == b[j - 1] ? 0 : 1;
+			int val = min(d[(i - 1) * cols + j - 1] + cost, min(d[i * cols + j - 1], d[(i - 1) * cols + j]) + 1);
+			if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1])
+				val = min(val, d[(i - 2) * cols + j - 2] + 1);
+			d[i * cols + j] = val;
 		}
 	}
+	return d[len_a * cols + len_b];
+}
+
+// xorshift, so the random strings are the same on every run
+uint64_t check_random(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
 
-	unsigned int dctImageMatrix[n][m];
-	for (i = 0; i < n; i++)
+// Copy of word with a few random edits, moved letters included so gapped
+// transpositions come up. out has to hold len + 4 characters
+void check_mutate(const char *word, char *out, uint64_t *state)
+{
+	int len = strlen(word);
+	memcpy(out, word, len + 1);
+	int edits = 1 + check_random(state) % 3;
+	for (int e = 0; e < edits && len > 0; e++)
 	{
-		for (j = 0; j < m; j++)
+		int i = check_random(state) % len;
+		int j = min(len - 1, i + 1 + (int)(check_random(state) % 3));
+		switch (check_random(state) % 4)
 		{
-			if (dct[i][j] > avg)
+		case 0:
+			// Moves the letter at i to j
 			{
-				dctImageMatrix[i][j] = 0;
+				char c = out[i];
+				memmove(out + i, out + i + 1, j - i);
+				out[j] = c;
 			}
-			else
+			break;
+		case 1:
+			out[i] = 'a' + check_random(state) % 26;
+			break;
+		case 2:
+			if (len < (int)strlen(word) + 3)
 			{
-				dctImageMatrix[i][j] = 255;
+				memmove(out + i + 1, out + i, len - i + 1);
+				out[i] = out[j];
+				len++;
 			}
+			break;
+		default:
+			memmove(out + i, out + i + 1, len - i);
+			len--;
+			break;
 		}
 	}
-	Image dctImage = {
-		.data = dctImageMatrix,
-		.width = n,
-		.height = m,
-		.format = PIXELFORMAT_UNCOMPRESSED_GRAYSCALE,
-		.mipmaps = 1};
-	Image allocatedDct = ImageCopy(dctImage);
-	ImageResize(&allocatedDct, 255, 255);
-	ExportImage(allocatedDct, "dct.png");
-
-	UnloadImage(copy);
-	return result;
 }
 
-void insertImage(ImageNode *root, char *path)
+// Compares every way of working out the distance between a and b with
+// damerau_levenshtein_distance_dp. Returns the number of mismatches
+int check_pair(DistanceWorkspace *ws, int *osa_d, const char *a, const char *b)
 {
-	ImageNode *curr = root;
-	Image image = LoadImage(path);
-
-	if (!IsImageValid(image))
+	int len_a = strlen(a);
+	int len_b = strlen(b);
+	int expected = damerau_levenshtein_distance_dp(ws, a, len_a, b, len_b);
+	int osa = osa_distance_dp(osa_d, a, len_a, b, len_b);
+	int wrong = 0;
+	const char *what = NULL;
+	int got = 0;
+	if ((got = osa_distance_ws(ws, a, len_a, b, len_b)) != osa)
+		what = "osa";
+	else if (osa < expected)
+		what = "osa below dl";
+	else if ((got = damerau_levenshtein_distance_ws(ws, a, b)) != expected)
+		what = "dispatch";
+	if (what != NULL)
 	{
-		UnloadImage(image);
-		printf("Invalid image provided");
-		return;
+		printf("%s: \"%s\" \"%s\" got %d, dp %d, osa %d\n", what, a, b, got, expected, osa);
+		wrong++;
 	}
-
-	ImageNode *newNode = createImageNode(image, path);
-	while (curr != NULL)
+	PreparedQuery pq;
+	prepare_query(&pq, a);
+	if ((got = prepared_distance(ws, &pq, b)) != expected)
 	{
-		int distance = __builtin_popcount(curr->hash ^ newNode->hash);
-		int index = distance % HASH_SIZE;
-		ImageNode *next = curr->children[index];
-		if (next == NULL)
+		printf("prepared: \"%s\" \"%s\" got %d, dp %d\n", a, b, got, expected);
+		wrong++;
+	}
+	for (int limit = 0; limit <= 4; limit++)
+	{
+		int capped = min(expected, limit + 1);
+		int banded = damerau_levenshtein_distance_banded(ws, a, len_a, b, len_b, limit);
+		int bounded = damerau_levenshtein_distance_bounded(ws, a, b, limit);
+		int prepared = prepared_distance_bounded(ws, &pq, b, limit);
+		if (banded != capped || bounded != capped || prepared != capped)
 		{
-			curr->children[index] = newNode;
-			break;
+			printf("limit %d: \"%s\" \"%s\" banded %d, bounded %d, prepared %d, dp %d\n", limit, a, b, banded, bounded, prepared, expected);
+			wrong++;
 		}
-		curr = next;
 	}
-	UnloadImage(image);
+	return wrong;
 }
 
-CharStack *searchImages(ImageNode *root, Image image, int radius, int max)
+// Same as check_pair for the batch kernels, count words against one query
+int check_batch(DistanceWorkspace *ws, const char *query, const char **words, int count)
 {
-	if (root == NULL)
+	PreparedQuery pq;
+	prepare_query(&pq, query);
+	int limits[DISTANCE_BATCH] = {0};
+	int out[DISTANCE_BATCH] = {0};
+	for (int i = 0; i < count; i++)
+		limits[i] = i % 5;
+	prepared_distance_batch(ws, &pq, words, limits, count, out);
+	int wrong = 0;
+	for (int i = 0; i < count; i++)
 	{
-		return NULL;
+		int expected = min(damerau_levenshtein_distance_dp(ws, query, strlen(query), words[i], strlen(words[i])), limits[i] + 1);
+		if (out[i] != expected)
+		{
+			printf("batch limit %d: \"%s\" \"%s\" got %d, dp %d\n", limits[i], query, words[i], out[i], expected);
+			wrong++;
+		}
 	}
-	unsigned long long int searchHash = dctTransform(image);
+	return wrong;
+}
 
-	ImageNodeStack *stack = push_image_node(NULL, root);
-	CharStack *potential[radius + 1];
-	for (int i = 0; i < radius + 1; i++)
+// Every distance function against the full DP: each word of words.txt with a
+// few edited copies of itself and the next word, then random strings over a
+// small alphabet, many of them past the 64 characters of the single word engine
+bool check_distance(void)
+{
+	char *string;
+	uint32_t count;
+	char **words = bench_read_words(&string, &count);
+	if (words == NULL)
 	{
-		potential[i] = NULL;
+		return false;
 	}
-	CharStack *results = NULL;
-	while (stack != NULL)
+	DistanceWorkspace ws;
+	init_workspace(&ws);
+	// Room for the OSA matrix of the longest strings below
+	int longest = 0;
+	for (uint32_t i = 0; i < count; i++)
+		longest = max(longest, strlen(words[i]));
+	int size = max(longest + 4, 200) + 1;
+	int *osa_d = malloc((size_t)size * size * sizeof(int));
+	char *a = malloc(size);
+	char *b = malloc(size);
+	uint64_t state = 88172645463325252ull;
+	int wrong = 0;
+	long pairs = 0;
+	for (uint32_t i = 0; i < count && wrong < 20; i++)
 	{
-		ImageNode *curr = pop_image_node(&stack);
-		int distance = __builtin_popcount(curr->hash ^ searchHash);
-		if (distance <= radius)
+		for (int m = 0; m < 3; m++, pairs++)
 		{
-			potential[distance] = push_char(potential[distance], curr->path);
+			check_mutate(words[i], a, &state);
+			wrong += check_pair(&ws, osa_d, words[i], a);
 		}
-		int lower = fmax(distance - radius, 0);
-		int upper = min(distance + radius, HASH_SIZE - 1);
-		for (int i = lower; i <= upper; i++)
+		if (i + 1 < count)
 		{
-			if (curr->children[i])
-			{
-				stack = push_image_node(stack, curr->children[i]);
-			}
+			wrong += check_pair(&ws, osa_d, words[i], words[i + 1]);
+			pairs++;
 		}
 	}
-	int curr_dist = 0;
-	while ((results == NULL || results->len < max) && curr_dist <= radius)
+	for (uint32_t i = 0; i + DISTANCE_BATCH <= count && wrong < 20; i += DISTANCE_BATCH)
+	{
+		wrong += check_batch(&ws, words[(i * 7919ull) % count], (const char **)words + i, DISTANCE_BATCH);
+		pairs += DISTANCE_BATCH;
+	}
+	for (int r = 0; r < 200000 && wrong < 20; r++, pairs++)
 	{
-		char *res = pop_char(&potential[curr_dist]);
-		if (res == NULL)
+		int alphabet = 2 + check_random(&state) % 4;
+		// Mostly short, every tenth one long enough for the blocked engine
+		int max_len = r % 10 == 0 ? size - 4 : 12;
+		int len_a = check_random(&state) % (max_len + 1);
+		for (int k = 0; k < len_a; k++)
+			a[k] = 'a' + check_random(&state) % alphabet;
+		a[len_a] = '\0';
+		if (r % 2 == 0)
 		{
-			curr_dist++;
+			// An edited copy, the distance is small enough for the limits
+			check_mutate(a, b, &state);
 		}
 		else
 		{
-			results = push_back_char(results, res);
+			int len_b = check_random(&state) % (max_len + 1);
+			for (int k = 0; k < len_b; k++)
+				b[k] = 'a' + check_random(&state) % alphabet;
+			b[len_b] = '\0';
 		}
+		wrong += check_pair(&ws, osa_d, a, b);
 	}
-	return results;
+	printf("%ld pairs, %d mismatches\n", pairs, wrong);
+	free(a);
+	free(b);
+	free(osa_d);
+	free_workspace(&ws);
+	free(words);
+	free(string);
+	return wrong == 0;
 }
 
-void *index_images(void *args)
+// Decodes damaged copies of the JPEGs in images/ (cut short, bytes changed
+// in the headers and anywhere, Huffman table lengths made up) and checks each
+// either fails or gives an image the size its frame header asks for. Meant to
+// be run from a build with the address sanitizer, which is what catches reads
+// and writes out of bounds
+bool check_jpeg(void)
 {
-	struct ImageIndexArguments *arguments = args;
-
-	ImageNode **root = arguments->root;
-	size_t *completed = arguments->completed;
 	if (!DirectoryExists("images"))
 	{
 		printf("No image directory\n");
-		*arguments->done = true;
-		pthread_exit(0);
-	}
-	FilePathList imageDirFiles = LoadDirectoryFiles("images");
-	if (imageDirFiles.count < 1)
-	{
-		printf("No images found\n");
-		*arguments->done = true;
-		UnloadDirectoryFiles(imageDirFiles);
-		pthread_exit(0);
+		return false;
 	}
-	int i = 0;
-	Image firstImage;
-	for (i = 0; i < imageDirFiles.count; i++)
+	FilePathList files = LoadDirectoryFiles("images");
+	uint64_t state = 88172645463325252ull;
+	int tried = 0, decoded = 0, wrong = 0;
+	for (unsigned int i = 0; i < files.count; i++)
 	{
-		firstImage = LoadImage(imageDirFiles.paths[i]);
-		if (IsImageValid(firstImage))
+		size_t size = 0;
+		unsigned char *data = map_file(files.paths[i], &size);
+		// Small ones only, the damage is what's being checked
+		if (data == NULL || size > 300000 || size < 4 || data[0] != 0xFF || data[1] != 0xD8)
 		{
-			*root = createImageNode(firstImage, imageDirFiles.paths[i]);
-			UnloadImage(firstImage);
-			break;
+			if (data != NULL)
+				unmap_file(data, size);
+			continue;
 		}
-		UnloadImage(firstImage);
+		unsigned char *copy = malloc(size);
+		for (int m = 0; m < 24; m++, tried++)
+		{
+			memcpy(copy, data, size);
+			size_t length = size;
+			switch (m % 4)
+			{
+			case 0:
+				length = 2 + check_random(&state) % (size - 2);
+				break;
+			case 1:
+				// Headers sit in the first few KB
+				for (int k = 0; k < 1 + m / 4; k++)
+					copy[2 + check_random(&state) % min(size - 2, 4096)] = check_random(&state);
+				break;
+			case 2:
+				for (int k = 0; k < 1 + m / 4; k++)
+					copy[2 + check_random(&state) % (size - 2)] = check_random(&state);
+				break;
+			default:
+				// Code counts of a Huffman table
+				for (size_t p = 2; p + 21 < size; p++)
+				{
+					if (copy[p] == 0xFF && copy[p + 1] == 0xC4)
+					{
+						copy[p + 5 + check_random(&state) % 16] = check_random(&state);
+						break;
+					}
+				}
+				break;
+			}
+			Image image = decode_jpeg_luma(copy, length);
+			if (image.data == NULL)
+				continue;
+			decoded++;
+			// Dimensions from the frame header, going segment by segment so
+			// thumbnails in APP segments don't count. Left at 0 when the damage
+			// makes that walk lose its way
+			int width = 0, height = 0;
+			for (size_t p = 2; p + 8 < length && copy[p] == 0xFF && copy[p + 1] != 0xDA; p += 2 + (copy[p + 2] << 8 | copy[p + 3]))
+			{
+				if (copy[p + 1] >= 0xC0 && copy[p + 1] <= 0xC2)
+				{
+					height = copy[p + 5] << 8 | copy[p + 6];
+					width = copy[p + 7] << 8 | copy[p + 8];
+					break;
+				}
+			}
+			int scale = (width + image.width - 1) / max(image.width, 1);
+			if (width != 0 && (image.width != (width + scale - 1) / scale || image.height != (height + scale - 1) / scale || (scale != 1 && scale != 2 && scale != 4 && scale != 8)))
+			{
+				printf("%s copy %d: %dx%d from a %dx%d frame\n", files.paths[i], m, image.width, image.height, width, height);
+				wrong++;
+			}
+			free(image.data);
+		}
+		free(copy);
+		unmap_file(data, size);
 	}
-	*(arguments->total) = imageDirFiles.count;
-	if (*root == NULL)
+	UnloadDirectoryFiles(files);
+	printf("%d damaged JPEGs, %d still decoded, %d wrong sizes\n", tried, decoded, wrong);
+	return wrong == 0 && tried > 0;
+}
+
+// Number of kernels whose hash of pixels isn't the one original_dct_hash gives
+int check_dct_pixels(const unsigned char *pixels, DctKernel *kernels, int count)
+{
+	unsigned long long int expected = original_dct_hash(pixels);
+	int wrong = 0;
+	for (int k = 0; k < count; k++)
 	{
-		printf("No valid images found\n");
-		*arguments->done = true;
-		UnloadDirectoryFiles(imageDirFiles);
-		pthread_exit(0);
+		float dct[DCT_SIZE][DCT_SIZE];
+		float average;
+		kernels[k](pixels, dct);
+		wrong += dct_hash_bits(dct, &average) != expected;
+	}
+	return wrong;
+}
+
+// Hashes with every DCT kernel the CPU has against the transform from before
+// it was table driven, over every image in images/ (decoded in full and
+// shrunk) and over made up ones: flat, gradients so shallow the hash comes
+// from rounding, steeper ones and noisy ones
+bool check_dct(void)
+{
+	pthread_once(&dctOnce, init_dct);
+	DctKernel kernels[2] = {dct_hash_block_scalar};
+	int kernelCount = 1;
+	if (dctKernel != dct_hash_block_scalar)
+		kernels[kernelCount++] = dctKernel;
+	int wrong = 0;
+	int images = 0;
+	if (DirectoryExists("images"))
+	{
+		FilePathList files = LoadDirectoryFiles("images");
+		for (unsigned int i = 0; i < files.count; i++)
+		{
+			Image decoded[2] = {LoadImage(files.paths[i]), load_hash_image(files.paths[i])};
+			for (int d = 0; d < 2; d++)
+			{
+				if (IsImageValid(decoded[d]))
+				{
+					Image input = dct_input(decoded[d]);
+					wrong += check_dct_pixels(input.data, kernels, kernelCount);
+					images++;
+					UnloadImage(input);
+				}
+				UnloadImage(decoded[d]);
+			}
+		}
+		UnloadDirectoryFiles(files);
 	}
-	printf("checked root\n");
-	for (; i < imageDirFiles.count && !*arguments->kill; i++)
+	uint64_t state = 88172645463325252ull;
+	unsigned char pixels[DCT_SIZE * DCT_SIZE];
+	for (int n = 0; n < 20000; n++, images++)
 	{
-		insertImage(*root, imageDirFiles.paths[i]);
-		*arguments->completed = i;
+		double steepness[4] = {0, 0.05, 1, 3};
+		double base = check_random(&state) % 256;
+		double across = ((int)(check_random(&state) % 2001) - 1000) / 1000.0 * steepness[n % 4];
+		double down = ((int)(check_random(&state) % 2001) - 1000) / 1000.0 * steepness[n % 4];
+		int noise = n % 8 == 7 ? 41 : 1;
+		for (int k = 0; k < DCT_SIZE; k++)
+		{
+			for (int l = 0; l < DCT_SIZE; l++)
+			{
+				double value = base + across * l + down * k + (int)(check_random(&state) % noise) - noise / 2;
+				pixels[k * DCT_SIZE + l] = lround(fmin(fmax(value, 0), 255));
+			}
+		}
+		wrong += check_dct_pixels(pixels, kernels, kernelCount);
 	}
-	UnloadDirectoryFiles(imageDirFiles);
-	*arguments->done = true;
-	pthread_exit(0);
+	printf("%d images, %d kernels, %d different hashes\n", images, kernelCount, wrong);
+	return wrong == 0;
 }
 
-void serializeImages(ImageNode *root, FILE *fp)
+// Whether tree holds the same nodes and words as expected
+bool same_tree(const WordTree *tree, const WordTree *expected)
 {
-	if (root == NULL)
+	return tree->count == expected->count && tree->wordsLength == expected->wordsLength &&
+		   memcmp(tree->nodes, expected->nodes, expected->count * sizeof(Node)) == 0 &&
+		   memcmp(tree->words, expected->words, expected->wordsLength) == 0;
+}
+
+// Writes a copy of the file at path with node's distance or first child
+// changed and checks map_tree turns it down
+bool check_damaged_tree(const char *path, const char *damaged, uint32_t node, int distance, uint32_t firstChild)
+{
+	size_t size = 0;
+	char *data = map_file(path, &size);
+	if (data == NULL)
+		return false;
+	char *copy = malloc(size);
+	memcpy(copy, data, size);
+	unmap_file(data, size);
+	Node *nodes = (Node *)(copy + ((TreeFileHeader *)copy)->nodesOffset);
+	if (distance >= 0)
+		nodes[node].distance = distance;
+	if (firstChild != NO_NODE)
+		nodes[node].firstChild = firstChild;
+	FILE *file = fopen(damaged, "wb");
+	bool written = file != NULL && fwrite(copy, size, 1, file) == 1;
+	if (file != NULL)
+		fclose(file);
+	free(copy);
+	WordTree tree;
+	init_tree(&tree);
+	bool rejected = written && map_tree(&tree, damaged) == -1;
+	free_tree(&tree);
+	remove(damaged);
+	return rejected;
+}
+
+// Saves a tree, loads it back and saves the loaded (mapped) tree over the file
+// it came from, which has to give the same tree again. Then checks damaged
+// copies of the file are turned down instead of mapped
+bool check_tree(void)
+{
+	const char *path = "bktree.check.bin";
+	const char *damaged = "bktree.check.damaged.bin";
+	char *string;
+	uint32_t count;
+	char **words = bench_read_words(&string, &count);
+	if (words == NULL)
 	{
-		return;
+		return false;
+	}
+	WordTree tree;
+	init_tree(&tree);
+	DistanceWorkspace ws;
+	init_workspace(&ws);
+	for (uint32_t i = 0; i < count && i < 20000; i++)
+		insert(&tree, words[i], &ws);
+	reorder_tree(&tree);
+	bool ok = true;
+	for (int round = 0; round < 2 && ok; round++)
+	{
+		// The second round saves the mapping of the file over the file
+		WordTree loaded;
+		init_tree(&loaded);
+		ok = (round == 0 ? write_tree(&tree, path) : true) && map_tree(&loaded, path) == 1 && same_tree(&loaded, &tree);
+		if (ok && round == 0)
+			ok = write_tree(&loaded, path) && same_tree(&loaded, &tree);
+		free_tree(&loaded);
+		printf("round trip %d: %s\n", round + 1, ok ? "same tree" : "different");
+	}
+	if (ok)
+	{
+		// Children of the root made to go down, to go up to MAX_CHAR and to
+		// link outside the node array
+		uint32_t first = tree.nodes[ROOT_NODE].firstChild;
+		uint32_t second = tree.nodes[first].nextSibling;
+		uint32_t last = first;
+		while (tree.nodes[last].nextSibling != NO_NODE)
+			last = tree.nodes[last].nextSibling;
+		ok = second != NO_NODE &&
+			 check_damaged_tree(path, damaged, second, tree.nodes[first].distance, NO_NODE) &&
+			 check_damaged_tree(path, damaged, last, MAX_CHAR, NO_NODE) &&
+			 check_damaged_tree(path, damaged, first, -1, tree.count);
+		printf("damaged trees: %s\n", ok ? "turned down" : "mapped");
 	}
+	remove(path);
+	free_tree(&tree);
+	free_workspace(&ws);
+	free(words);
+	free(string);
+	return ok;
+}
 
-	fprintf(fp, "%s %lld :::", root->path, root->hash);
-	for (int i = 0; i < HASH_SIZE; i++)
+typedef struct Check
+{
+	const char *name;
+	bool (*run)(void);
+} Check;
+
+Check checks[] = {
+	{"distance", check_distance},
+	{"jpeg", check_jpeg},
+	{"tree", check_tree},
+	{"dct", check_dct},
+};
+
+// Runs the check called name, or all of them when name is NULL. Fails if any of
+// them does
+int run_checks(const char *name)
+{
+	bool found = false;
+	bool passed = true;
+	for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++)
 	{
-		if (root->children[i])
+		if (name == NULL || strcmp(name, checks[i].name) == 0)
 		{
-			fprintf(fp, "%d --", i);
-			serializeImages(root->children[i], fp);
+			printf("== %s ==\n", checks[i].name);
+			bool ok = checks[i].run();
+			printf("%s\n", ok ? "ok" : "FAILED");
+			passed = passed && ok;
+			found = true;
 		}
 	}
-	fprintf(fp, "%s :::", MARKER);
+	if (!found)
+	{
+		printf("Unknown check %s\n", name);
+		return 1;
+	}
+	return passed ? 0 : 1;
 }
 
-void writeImages(ImageNode *root)
+// Recent searches of the GUI, so searching for the same thing again doesn't
+// go through a tree. The results point into the word tree or the image nodes,
+// the GUI clears the cache whenever either changes
+#define RESULT_CACHE_SIZE 64
+// What kind of search a cached result is from
+#define CACHE_WORDS 0
+#define CACHE_NEAREST 1
+#define CACHE_IMAGES 2
+
+typedef struct CachedResult
 {
-	FILE *file = fopen("imagetree.bin", "wb");
-	if (file != NULL)
+	int kind;
+	uint64_t hash;
+	char *query;
+	// Modification time of the image, it's searched for again once it changes
+	long stamp;
+	int radius;
+	int max;
+	CharStack results;
+	// Entries that haven't been used for the longest go first
+	uint64_t lastUsed;
+} CachedResult;
+
+typedef struct ResultCache
+{
+	CachedResult entries[RESULT_CACHE_SIZE];
+	int count;
+	uint64_t clock;
+	size_t hits;
+	size_t misses;
+} ResultCache;
+
+// FNV-1a
+uint64_t hash_query(const char *query)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (const unsigned char *c = (const unsigned char *)query; *c; c++)
 	{
-		serializeImages(root, file);
-		fclose(file);
+		hash = (hash ^ *c) * 1099511628211ULL;
 	}
+	return hash;
 }
 
-void deserializeImages(ImageNode **root, FILE *fp, size_t *completed, bool *kill)
+CachedResult *find_cached(ResultCache *cache, int kind, const char *query, long stamp, int radius, int max)
 {
-	char val[128];
-	unsigned long long int hash;
-	if (!fscanf(fp, "%s %lld :::", (char *)&val, &hash) || strcmp(val, MARKER) == 0)
-		return;
+	uint64_t hash = hash_query(query);
+	for (int i = 0; i < cache->count; i++)
+	{
+		CachedResult *entry = &cache->entries[i];
+		if (entry->hash == hash && entry->kind == kind && entry->stamp == stamp && entry->radius == radius &&
+			entry->max == max && strcmp(entry->query, query) == 0)
+			return entry;
+	}
+	return NULL;
+}
 
-	// Else create node with this item and recur for children
-	*root = createImageNodeWithHash(val, hash);
-	*completed = ftell(fp);
-	int idx;
-	while (fscanf(fp, "%d --", &idx) && !*kill)
+// Copies the cached results for the search into results if there are any
+bool cache_lookup(ResultCache *cache, int kind, const char *query, long stamp, int radius, int max, CharStack *results)
+{
+	CachedResult *entry = find_cached(cache, kind, query, stamp, radius, max);
+	if (entry == NULL)
 	{
-		deserializeImages(&(*root)->children[idx], fp, completed, kill);
+		cache->misses++;
+		return false;
 	}
-	if (*kill)
+	cache->hits++;
+	entry->lastUsed = ++cache->clock;
+	results->len = 0;
+	for (int i = 0; i < entry->results.len; i++)
 	{
-		return;
+		push_char(results, entry->results.words[i]);
 	}
-	fscanf(fp, "%s :::", (char *)&val);
-	if (strcmp(val, MARKER) != 0)
+	return true;
+}
+
+void cache_store(ResultCache *cache, int kind, const char *query, long stamp, int radius, int max, const CharStack *results)
+{
+	CachedResult *entry = find_cached(cache, kind, query, stamp, radius, max);
+	if (entry == NULL && cache->count < RESULT_CACHE_SIZE)
 	{
-		exit(1);
+		entry = &cache->entries[cache->count++];
+		*entry = (CachedResult){0};
+	}
+	else if (entry == NULL)
+	{
+		entry = &cache->entries[0];
+		for (int i = 1; i < cache->count; i++)
+		{
+			if (cache->entries[i].lastUsed < entry->lastUsed)
+				entry = &cache->entries[i];
+		}
+		free(entry->query);
+	}
+	else
+	{
+		free(entry->query);
+	}
+	entry->kind = kind;
+	entry->hash = hash_query(query);
+	entry->query = strdup(query);
+	entry->stamp = stamp;
+	entry->radius = radius;
+	entry->max = max;
+	entry->lastUsed = ++cache->clock;
+	entry->results.len = 0;
+	for (int i = 0; i < results->len; i++)
+	{
+		push_char(&entry->results, results->words[i]);
 	}
-	// Finally return 0 for successful finish
-	return;
 }
 
-void readImages(ImageNode **root, size_t *total, size_t *completed, bool *kill)
+// Drops every entry, the hit and miss counts stay
+void clear_cache(ResultCache *cache)
 {
-	FILE *file = fopen("imagetree.bin", "r");
-	if (file != NULL)
+	for (int i = 0; i < cache->count; i++)
 	{
-		fseek(file, 0, SEEK_END);
-		long fsize = ftell(file);
-		fseek(file, 0, SEEK_SET); /* same as rewind(f); */
-		*total = fsize;
-		deserializeImages(root, file, completed, kill);
-		fclose(file);
-		// print_tree(root);
+		free(cache->entries[i].query);
+		free_chars(&cache->entries[i].results);
 	}
+	cache->count = 0;
 }
 
-void *loadImages(void *args)
+// Adds a line to the search results text, growing it as needed
+void append_result(char **text, int *capacity, int *length, const char *result)
 {
-	ImageIndexArguments *arguments = args;
-	readImages(arguments->root, arguments->total, arguments->completed, arguments->kill);
-	*arguments->done = true;
-	pthread_exit(0);
+	int needed = *length + strlen(result) + 2;
+	if (needed > *capacity)
+	{
+		while (needed > *capacity)
+			*capacity *= 2;
+		*text = realloc(*text, *capacity);
+	}
+	*length += snprintf(*text + *length, *capacity - *length, "%s\n", result);
 }
 
 //------------------------------------------------------------------------------------
 // Program main entry point
 //------------------------------------------------------------------------------------
-int main(void)
+int main(int argc, char **argv)
 {
+	if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+	{
+		return run_benchmarks(argc > 2 ? argv[2] : NULL);
+	}
+	if (argc > 1 && strcmp(argv[1], "--check") == 0)
+	{
+		return run_checks(argc > 2 ? argv[2] : NULL);
+	}
+	if (argc > 2 && strcmp(argv[1], "--dct-debug") == 0)
+	{
+		DctDebugDirectory = argv[2];
+		if (!DirectoryExists(DctDebugDirectory))
+			MakeDirectory(DctDebugDirectory);
+	}
+
 	// Initialization
 	//---------------------------------------------------------------------------------------
 	int screenWidth = 680;
@@ -960,8 +5973,36 @@ int main(void)
 	struct ImageIndexArguments imageIndexArguments;
 	pthread_t ImagesThread;
 
-	Node *root = NULL;
+	WordTree tree;
+	init_tree(&tree);
 	ImageNode *imageRoot = NULL;
+	// Distance scratch space for searches run on the GUI thread
+	DistanceWorkspace searchWorkspace;
+	init_workspace(&searchWorkspace);
+	// Reused by every word and image search
+	CharStack searchResults = {0};
+	int SearchResultLength = 0;
+	// Streaming search thread info
+	StreamingSearch streaming = {0};
+	pthread_mutex_init(&streaming.lock, NULL);
+	pthread_t StreamingThread;
+	bool StreamingRunning = false;
+	bool StreamResults = true;
+	// What the streaming search gets cached under once it's done
+	int StreamingRadius = 0;
+	ResultCache resultCache = {0};
+	// Search as you type, from a trie built the first time it's needed
+	bool SearchAsYouType = false;
+	WordTrie wordTrie;
+	init_trie(&wordTrie);
+	char LiveText[128] = "";
+	int LiveDistance = -1;
+	// Searches up to DELETE_INDEX_DISTANCE from the deletes index instead of
+	// the tree, built the first time it's needed too
+	bool UseDeleteIndex = false;
+	DeleteIndex deleteIndex;
+	init_delete_index(&deleteIndex);
+	char CacheStatusText[128] = "";
 
 	bool imageSearchResults = false;
 	//----------------------------------------------------------------------------------
@@ -978,9 +6019,18 @@ int main(void)
 		// TODO: Implement required update logic
 		//----------------------------------------------------------------------------------
 
-		if (IndexingDone)
+		// A streaming search started during the build may still be walking the
+		// tree, reorder_tree frees it, so that waits until the stream is over
+		if (IndexingDone && !StreamingRunning)
 		{
 			pthread_join(IndexingThread, NULL);
+			// Searches read the tree during the build, it can only be moved
+			// around once the build is over, here on the thread that searches
+			reorder_tree(&tree);
+			clear_cache(&resultCache);
+			free_trie(&wordTrie);
+			free_delete_index(&deleteIndex);
+			LiveDistance = -1;
 			IndexingRunning = false;
 			IndexingCompleted = 0;
 			IndexingTotal = 0;
@@ -988,9 +6038,33 @@ int main(void)
 			KillIndexing = false;
 		}
 
+		if (StreamingRunning)
+		{
+			// Checked first so nothing found after the last take gets lost
+			bool finished = __atomic_load_n(&streaming.done, __ATOMIC_ACQUIRE);
+			pthread_mutex_lock(&streaming.lock);
+			for (int i = 0; i < streaming.found.len; i++)
+			{
+				append_result(&SearchResultText, &CurrMaxResultSize, &SearchResultLength, streaming.found.words[i]);
+				push_char(&searchResults, streaming.found.words[i]);
+			}
+			streaming.found.len = 0;
+			pthread_mutex_unlock(&streaming.lock);
+			if (finished)
+			{
+				pthread_join(StreamingThread, NULL);
+				StreamingRunning = false;
+				if (!IndexingRunning && !LoadingRunning)
+					cache_store(&resultCache, CACHE_WORDS, streaming.query, 0, StreamingRadius, INT_MAX, &searchResults);
+			}
+		}
 		if (LoadingDone)
 		{
 			pthread_join(LoadingThread, NULL);
+			clear_cache(&resultCache);
+			free_trie(&wordTrie);
+			free_delete_index(&deleteIndex);
+			LiveDistance = -1;
 			LoadingCompleted = 0;
 			LoadingTotal = 0;
 			LoadingDone = false;
@@ -1001,6 +6075,7 @@ int main(void)
 		if (ImagesDone)
 		{
 			pthread_join(ImagesThread, NULL);
+			clear_cache(&resultCache);
 			ImagesCompleted = 0;
 			ImagesTotal = 0;
 			ImagesDone = false;
@@ -1019,35 +6094,41 @@ int main(void)
 			else
 			{
 				char *path = dropped.paths[0];
-				Image image = LoadImage(path);
-				if (!IsImageValid(image))
+				int distance = atoi(TextBox009Text);
+				if (!distance)
+				{
+					distance = 5;
+				}
+				long stamp = GetFileModTime(path);
+				// The cache can't hold results from an image tree still being built
+				bool cached = !ImagesRunning && cache_lookup(&resultCache, CACHE_IMAGES, path, stamp, distance, INT_MAX, &searchResults);
+				Image image = {0};
+				if (!cached)
+					image = load_hash_image(path);
+				if (!cached && !IsImageValid(image))
 				{
 					printf("Only .png supported for now\n");
 					UnloadDroppedFiles(dropped);
 				}
 				else
 				{
+					stop_stream(&streaming, StreamingThread, &StreamingRunning);
 					memset(SearchResultText, 0, strlen(SearchResultText));
-					int distance = atoi(TextBox009Text);
-					if (!distance)
+					if (!cached)
 					{
-						distance = 5;
+						searchImages(imageRoot, image, path, distance, INT_MAX, &searchResults);
+						if (!ImagesRunning)
+							cache_store(&resultCache, CACHE_IMAGES, path, stamp, distance, INT_MAX, &searchResults);
 					}
-					CharStack *search_result = searchImages(imageRoot, image, distance, INT_MAX);
-					int result_length = 0;
-					while (search_result != NULL)
+					SearchResultLength = 0;
+					for (int i = 0; i < searchResults.len; i++)
 					{
-						char *result = pop_char(&search_result);
-						if (result_length + strlen(result) > CurrMaxResultSize)
-						{
-							CurrMaxResultSize *= 2;
-							SearchResultText = realloc(SearchResultText, CurrMaxResultSize);
-						}
-						result_length += snprintf(SearchResultText + result_length, CurrMaxResultSize - result_length, "%s\n", result);
+						append_result(&SearchResultText, &CurrMaxResultSize, &SearchResultLength, searchResults.words[i]);
 					}
 					imageSearchResults = true;
 				}
-				UnloadImage(image);
+				if (!cached)
+					UnloadImage(image);
 			}
 			UnloadDroppedFiles(dropped);
 		}
@@ -1097,17 +6178,34 @@ int main(void)
 		if (GuiTextBox((Rectangle){152, 34, 120, 24}, TextBox002Text, 128, TextBox002EditMode))
 			TextBox002EditMode = !TextBox002EditMode;
 		GuiStatusBar((Rectangle){524, 34, 150, 24}, EditDistanceResultText);
+		snprintf(CacheStatusText, sizeof(CacheStatusText), "Cache %zu hits %zu misses", resultCache.hits, resultCache.misses);
+		GuiStatusBar((Rectangle){450, 386, 222, 24}, CacheStatusText);
 		GuiLabel((Rectangle){8, 10, 120, 24}, "Word 1");
 		GuiLabel((Rectangle){152, 10, 120, 24}, "Word 2");
 		if (GuiButton((Rectangle){304, 34, 195, 24}, "Calculate Edit Distance"))
 		{
-			sprintf(EditDistanceResultText, "Edit distance: %d", damerau_levenshtein_distance(TextBox001Text, TextBox002Text));
+			// Reuse the max edit distance box as a cap when it's filled in
+			int cap = atoi(TextBox009Text);
+			if (cap > 0)
+			{
+				int distance = damerau_levenshtein_distance_bounded(&searchWorkspace, TextBox001Text, TextBox002Text, cap);
+				if (distance > cap)
+					sprintf(EditDistanceResultText, "Edit distance: > %d", cap);
+				else
+					sprintf(EditDistanceResultText, "Edit distance: %d", distance);
+			}
+			else
+				sprintf(EditDistanceResultText, "Edit distance: %d", damerau_levenshtein_distance_ws(&searchWorkspace, TextBox001Text, TextBox002Text));
 		}
 		if (GuiButton((Rectangle){8, 106, 120, 24}, "Build BK-Tree"))
 		{
 			// Free old index if exists
-			freeNode(root);
-			indexingArguments.root = &root;
+			stop_stream(&streaming, StreamingThread, &StreamingRunning);
+			clear_cache(&resultCache);
+			free_trie(&wordTrie);
+			free_delete_index(&deleteIndex);
+			free_tree(&tree);
+			indexingArguments.tree = &tree;
 			indexingArguments.completed = &IndexingCompleted;
 			indexingArguments.total = &IndexingTotal;
 			indexingArguments.done = &IndexingDone;
@@ -1115,20 +6213,23 @@ int main(void)
 			pthread_create(&IndexingThread, NULL, &create_tree, (void *)&indexingArguments);
 			IndexingRunning = true;
 		}
-		if (root == NULL && GuiGetState() != STATE_DISABLED)
+		if (tree_count(&tree) == 0 && GuiGetState() != STATE_DISABLED)
 		{
 			GuiDisable();
 			GuiButton((Rectangle){152, 106, 120, 24}, "Save BK-Tree");
 			GuiEnable();
 		}
 		else if (GuiButton((Rectangle){152, 106, 120, 24}, "Save BK-Tree"))
-			write_tree(root);
+			write_tree(&tree, "bktree.bin");
 
 		if (GuiButton((Rectangle){304, 106, 120, 24}, "Load BK-Tree"))
 		{
-			freeNode(root);
-			root = NULL;
-			loadingArguments.root = &root;
+			stop_stream(&streaming, StreamingThread, &StreamingRunning);
+			clear_cache(&resultCache);
+			free_trie(&wordTrie);
+			free_delete_index(&deleteIndex);
+			free_tree(&tree);
+			loadingArguments.tree = &tree;
 			loadingArguments.completed = &LoadingCompleted;
 			loadingArguments.total = &LoadingTotal;
 			loadingArguments.done = &LoadingDone;
@@ -1136,41 +6237,118 @@ int main(void)
 			pthread_create(&LoadingThread, NULL, &load_tree, (void *)&loadingArguments);
 			LoadingRunning = true;
 		}
+		// Searching stays available while the word tree is built or loaded, it
+		// sees whatever part of the tree is there so far
+		int savedState = GuiGetState();
+		GuiEnable();
 		if (GuiTextBox((Rectangle){8, 186, 120, 24}, TextBox008Text, 128, TextBox008EditMode))
 			TextBox008EditMode = !TextBox008EditMode;
 		if (GuiTextBox((Rectangle){152, 186, 120, 24}, TextBox009Text, 128, TextBox009EditMode))
 			TextBox009EditMode = !TextBox009EditMode;
 		GuiLabel((Rectangle){8, 162, 120, 24}, "Search Term");
 		GuiLabel((Rectangle){152, 162, 120, 24}, "Max edit distance");
-
-		if (root == NULL && GuiGetState() != STATE_DISABLED)
+		GuiCheckBox((Rectangle){304, 166, 16, 16}, "As you type", &SearchAsYouType);
+		// Only once the tree is done, the trie is built from all of it
+		if (SearchAsYouType && tree_count(&tree) > 0 && !IndexingRunning && !LoadingRunning)
 		{
-			GuiDisable();
-			GuiButton((Rectangle){304, 186, 120, 24}, "Search");
-			GuiEnable();
+			int distance = atoi(TextBox009Text);
+			if (!distance)
+			{
+				distance = 2;
+			}
+			if (strcmp(LiveText, TextBox008Text) != 0 || distance != LiveDistance)
+			{
+				snprintf(LiveText, sizeof(LiveText), "%s", TextBox008Text);
+				LiveDistance = distance;
+				if (wordTrie.count == 0)
+					build_trie(&wordTrie, &tree);
+				stop_stream(&streaming, StreamingThread, &StreamingRunning);
+				imageSearchResults = false;
+				memset(SearchResultText, 0, strlen(SearchResultText));
+				SearchResultLength = 0;
+				char queryText[128];
+				snprintf(queryText, sizeof(queryText), "%s", TextBox008Text);
+				char *query = trim(queryText);
+				searchResults.len = 0;
+				if (*query != '\0')
+					search_trie(&wordTrie, query, distance, INT_MAX, &searchWorkspace, &searchResults);
+				for (int i = 0; i < searchResults.len; i++)
+				{
+					append_result(&SearchResultText, &CurrMaxResultSize, &SearchResultLength, searchResults.words[i]);
+				}
+			}
 		}
-		else if (GuiButton((Rectangle){304, 186, 120, 24}, "Search"))
+
+		if (tree_count(&tree) == 0)
+			GuiDisable();
+		bool searchPressed = GuiButton((Rectangle){304, 186, 120, 24}, "Search");
+		bool closestPressed = GuiButton((Rectangle){304, 220, 120, 24}, TextFormat("%d Closest", NEAREST_COUNT));
+		GuiEnable();
+		GuiCheckBox((Rectangle){152, 224, 16, 16}, "Show as found", &StreamResults);
+		GuiCheckBox((Rectangle){8, 140, 16, 16}, "Search the deletes index", &UseDeleteIndex);
+		if (tree_count(&tree) > 0 && (searchPressed || closestPressed))
 		{
+			stop_stream(&streaming, StreamingThread, &StreamingRunning);
 			imageSearchResults = false;
 			memset(SearchResultText, 0, strlen(SearchResultText));
+			SearchResultLength = 0;
+			searchResults.len = 0;
+			// Surrounding spaces don't make it a different search
+			char queryText[128];
+			snprintf(queryText, sizeof(queryText), "%s", TextBox008Text);
+			char *query = trim(queryText);
 			int distance = atoi(TextBox009Text);
-			if (!distance)
+			int kind = closestPressed ? CACHE_NEAREST : CACHE_WORDS;
+			int maxResults = closestPressed ? NEAREST_COUNT : INT_MAX;
+			if (closestPressed && !distance)
+			{
+				// Any distance unless one was given
+				distance = MAX_CHAR;
+			}
+			else if (!distance)
 			{
 				distance = 2;
 			}
-			CharStack *search_result = search(root, TextBox008Text, distance, INT_MAX);
-			int result_length = 0;
-			while (search_result != NULL)
+			// A tree still being built or loaded can't use or fill the cache
+			bool treeFinal = !IndexingRunning && !LoadingRunning;
+			if (!treeFinal || !cache_lookup(&resultCache, kind, query, 0, distance, maxResults, &searchResults))
 			{
-				char *result = pop_char(&search_result);
-				if (result_length + strlen(result) > CurrMaxResultSize)
+				if (closestPressed)
+				{
+					search_nearest(&tree, query, NEAREST_COUNT, distance, &searchWorkspace, &searchResults);
+				}
+				else if (UseDeleteIndex && treeFinal && distance <= DELETE_INDEX_DISTANCE)
+				{
+					if (deleteIndex.entries == NULL)
+						build_delete_index(&deleteIndex, &tree, DELETE_INDEX_DISTANCE);
+					search_deletes(&deleteIndex, query, distance, INT_MAX, &searchWorkspace, &searchResults);
+				}
+				else if (StreamResults)
 				{
-					CurrMaxResultSize *= 2;
-					SearchResultText = realloc(SearchResultText, CurrMaxResultSize);
+					// Fills in over the next frames, closest first, and is
+					// cached once it's done
+					streaming.tree = &tree;
+					snprintf(streaming.query, sizeof(streaming.query), "%s", query);
+					streaming.radius = distance;
+					streaming.done = false;
+					streaming.kill = false;
+					StreamingRadius = distance;
+					pthread_create(&StreamingThread, NULL, stream_search, &streaming);
+					StreamingRunning = true;
 				}
-				result_length += snprintf(SearchResultText + result_length, CurrMaxResultSize - result_length, "%s\n", result);
+				else if (distance >= PARALLEL_SEARCH_RADIUS)
+					search_parallel(&tree, query, distance, INT_MAX, cpu_count(), SEARCH_GRAIN, &searchResults);
+				else
+					search(&tree, query, distance, INT_MAX, &searchWorkspace, &searchResults);
+				if (treeFinal && !StreamingRunning)
+					cache_store(&resultCache, kind, query, 0, distance, maxResults, &searchResults);
+			}
+			for (int i = 0; i < searchResults.len; i++)
+			{
+				append_result(&SearchResultText, &CurrMaxResultSize, &SearchResultLength, searchResults.words[i]);
 			}
 		}
+		GuiSetState(savedState);
 		if (IndexingRunning && IndexingTotal != 0)
 		{
 			float progress = ((float)IndexingCompleted / (float)IndexingTotal);
@@ -1201,6 +6379,7 @@ int main(void)
 
 		if (GuiButton((Rectangle){450, 186, 120, 24}, "Build Image Tree"))
 		{
+			clear_cache(&resultCache);
 			freeImageNode(imageRoot);
 			imageRoot = NULL;
 			imageIndexArguments = (ImageIndexArguments){.root = &imageRoot, .completed = &ImagesCompleted, .total = &ImagesTotal, .done = &ImagesDone, .kill = &KillImages};
@@ -1225,6 +6404,7 @@ int main(void)
 
 		if (GuiButton((Rectangle){450, 255, 120, 24}, "Load Image tree"))
 		{
+			clear_cache(&resultCache);
 			freeImageNode(imageRoot);
 			imageRoot = NULL;
 			imageIndexArguments = (ImageIndexArguments){.root = &imageRoot, .completed = &ImagesCompleted, .total = &ImagesTotal, .done = &ImagesDone, .kill = &KillImages};
@@ -1254,6 +6434,7 @@ int main(void)
 
 	// De-Initialization
 	//--------------------------------------------------------------------------------------
+	stop_stream(&streaming, StreamingThread, &StreamingRunning);
 	if (IndexingRunning)
 	{
 		KillIndexing = true;
@@ -1269,8 +6450,15 @@ int main(void)
 		KillImages = true;
 		pthread_join(ImagesThread, NULL);
 	}
-	freeNode(root);
+	free_tree(&tree);
 	freeImageNode(imageRoot);
+	pthread_mutex_destroy(&streaming.lock);
+	free_chars(&streaming.found);
+	clear_cache(&resultCache);
+	free_trie(&wordTrie);
+	free_delete_index(&deleteIndex);
+	free_workspace(&searchWorkspace);
+	free_chars(&searchResults);
 	free(SearchResultText);
 	CloseWindow(); // Close window and OpenGL context
 	//--------------------------------------------------------------------------------------